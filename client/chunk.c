@@ -0,0 +1,581 @@
+#define _GNU_SOURCE
+
+#include "chunk.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Chunk sizes. Cut points are only looked for between the minimum and the
+// maximum, and one is found on average every 2^CHUNK_MASK_BITS bytes after
+// the minimum.
+#define CHUNK_MIN_SIZE      (256 * 1024)
+#define CHUNK_MAX_SIZE      (4 * 1024 * 1024)
+#define CHUNK_MASK_BITS     20
+
+// Anything bigger than this is an ordinary file which happens to start with
+// the magic line. Allows for several GiB of chunks.
+#define MANIFEST_MAX_SIZE   (16 * 1024 * 1024)
+
+// Room for the magic line and the size line.
+#define MANIFEST_HEADER_MAX 64
+
+// Every client must cut at the same places, so the table is generated from a
+// fixed seed rather than at random.
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+static void gear_init(void)
+{
+    // splitmix64
+    uint64_t x = 0x7663667363686e6bULL;
+    for (int i = 0; i < 256; ++i) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+/**
+ * Returns the length of the chunk at the start of `buf`. `len` must only be
+ * less than CHUNK_MAX_SIZE at the end of the file.
+ */
+static size_t find_cut(const uint8_t *buf, size_t len)
+{
+    if (len <= CHUNK_MIN_SIZE) {
+        return len;
+    }
+    if (len > CHUNK_MAX_SIZE) {
+        len = CHUNK_MAX_SIZE;
+    }
+
+    const uint64_t mask = ((uint64_t)1 << CHUNK_MASK_BITS) - 1;
+    uint64_t h = 0;
+    for (size_t i = CHUNK_MIN_SIZE; i < len; ++i) {
+        h = (h << 1) + gear[buf[i]];
+        // Use the high bits, which depend on the most recent 64 bytes.
+        if (((h >> (64 - CHUNK_MASK_BITS)) & mask) == 0) {
+            return i + 1;
+        }
+    }
+    return len;
+}
+
+static void hash_to_hex(const uint8_t hash[VCFS_SHA256_SIZE], char hex[2 * VCFS_SHA256_SIZE + 1])
+{
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < VCFS_SHA256_SIZE; ++i) {
+        hex[2*i] = digits[hash[i] >> 4];
+        hex[2*i+1] = digits[hash[i] & 0xf];
+    }
+    hex[2 * VCFS_SHA256_SIZE] = '\0';
+}
+
+static int hex_to_hash(const char *hex, uint8_t hash[VCFS_SHA256_SIZE])
+{
+    for (int i = 0; i < 2 * VCFS_SHA256_SIZE; ++i) {
+        char c = hex[i];
+        int v;
+        if (c >= '0' && c <= '9') {
+            v = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            v = c - 'a' + 10;
+        } else {
+            return -1;
+        }
+        if (i % 2 == 0) {
+            hash[i/2] = v << 4;
+        } else {
+            hash[i/2] |= v;
+        }
+    }
+    return 0;
+}
+
+static int chunk_path(char *path, size_t size, const char *root, const uint8_t hash[VCFS_SHA256_SIZE])
+{
+    char hex[2 * VCFS_SHA256_SIZE + 1];
+    hash_to_hex(hash, hex);
+    int len = snprintf(path, size, "%s/" VCFS_CHUNK_DIR "/%.2s/%s", root, hex, hex);
+    return len < 0 || (size_t)len >= size ? -ENAMETOOLONG : 0;
+}
+
+static int write_full(int fd, const void *buf, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = write(fd, (const char *)buf + done, size - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -errno;
+        done += n;
+    }
+    return 0;
+}
+
+static ssize_t pread_full(int fd, void *buf, size_t size, off_t offset)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, (char *)buf + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -errno;
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+bool vcfs_manifest_probe(int fd, uint64_t *size)
+{
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)
+            || st.st_size < (off_t)sizeof(VCFS_MANIFEST_MAGIC) - 1
+            || st.st_size > MANIFEST_MAX_SIZE) {
+        return false;
+    }
+
+    char header[MANIFEST_HEADER_MAX + 1];
+    ssize_t n = pread_full(fd, header, MANIFEST_HEADER_MAX, 0);
+    if (n < (ssize_t)sizeof(VCFS_MANIFEST_MAGIC) - 1
+            || memcmp(header, VCFS_MANIFEST_MAGIC, sizeof(VCFS_MANIFEST_MAGIC) - 1) != 0) {
+        return false;
+    }
+    header[n] = '\0';
+
+    return sscanf(header + sizeof(VCFS_MANIFEST_MAGIC) - 1, "size %" SCNu64, size) == 1;
+}
+
+int vcfs_manifest_load(int fd, vcfs_manifest *m)
+{
+    memset(m, 0, sizeof(*m));
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        return -errno;
+    }
+    if (st.st_size > MANIFEST_MAX_SIZE) {
+        return -EFBIG;
+    }
+
+    char *text = (char *)malloc(st.st_size + 1);
+    if (text == NULL) {
+        return -ENOMEM;
+    }
+    ssize_t len = pread_full(fd, text, st.st_size, 0);
+    if (len < 0) {
+        free(text);
+        return len;
+    }
+    text[len] = '\0';
+
+    int res = -EIO;
+    char *line = text;
+    if (strncmp(line, VCFS_MANIFEST_MAGIC, sizeof(VCFS_MANIFEST_MAGIC) - 1) != 0) {
+        goto out;
+    }
+    line += sizeof(VCFS_MANIFEST_MAGIC) - 1;
+    if (sscanf(line, "size %" SCNu64, &m->size) != 1) {
+        goto out;
+    }
+
+    size_t cap = 0;
+    uint64_t offset = 0;
+    while ((line = strchr(line, '\n')) != NULL && *++line != '\0') {
+        vcfs_chunk chunk;
+        if (hex_to_hash(line, chunk.hash) || line[2 * VCFS_SHA256_SIZE] != ' '
+                || sscanf(line + 2 * VCFS_SHA256_SIZE + 1, "%" SCNu32, &chunk.len) != 1) {
+            goto out;
+        }
+        // We never write chunks outside these bounds, and readers size their
+        // buffers by them.
+        if (chunk.len == 0 || chunk.len > CHUNK_MAX_SIZE) {
+            goto out;
+        }
+        chunk.offset = offset;
+        offset += chunk.len;
+
+        if (m->n_chunks == cap) {
+            cap = cap ? 2 * cap : 64;
+            vcfs_chunk *grown = (vcfs_chunk *)realloc(m->chunks, cap * sizeof(vcfs_chunk));
+            if (grown == NULL) {
+                res = -ENOMEM;
+                goto out;
+            }
+            m->chunks = grown;
+        }
+        m->chunks[m->n_chunks++] = chunk;
+    }
+
+    if (offset == m->size) {
+        res = 0;
+    }
+
+out:
+    free(text);
+    if (res) {
+        vcfs_manifest_free(m);
+    }
+    return res;
+}
+
+void vcfs_manifest_free(vcfs_manifest *m)
+{
+    free(m->chunks);
+    memset(m, 0, sizeof(*m));
+}
+
+int vcfs_chunk_path(char *path, size_t size, const char *root, const vcfs_chunk *c)
+{
+    return chunk_path(path, size, root, c->hash);
+}
+
+int vcfs_chunk_open(const char *root, const vcfs_chunk *c)
+{
+    char path[PATH_MAX];
+    int res = chunk_path(path, sizeof(path), root, c->hash);
+    if (res) {
+        return res;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    return fd < 0 ? -errno : fd;
+}
+
+int vcfs_chunk_reader_open(vcfs_chunk_reader *r, const char *root, int manifest_fd)
+{
+    r->root = root;
+    r->fd = -1;
+    r->idx = 0;
+    return vcfs_manifest_load(manifest_fd, &r->manifest);
+}
+
+ssize_t vcfs_chunk_reader_read(vcfs_chunk_reader *r, char *buf, size_t size, off_t offset)
+{
+    const vcfs_manifest *m = &r->manifest;
+
+    if (offset < 0) {
+        return -EINVAL;
+    }
+    if ((uint64_t)offset >= m->size) {
+        return 0;
+    }
+    if (size > m->size - offset) {
+        size = m->size - offset;
+    }
+
+    // Reads are mostly sequential, so try the chunk we're on before searching.
+    size_t idx = r->idx;
+    if (idx >= m->n_chunks || (uint64_t)offset < m->chunks[idx].offset
+            || (uint64_t)offset >= m->chunks[idx].offset + m->chunks[idx].len) {
+        size_t lo = 0, hi = m->n_chunks;
+        while (hi - lo > 1) {
+            size_t mid = (lo + hi) / 2;
+            if (m->chunks[mid].offset <= (uint64_t)offset) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        idx = lo;
+    }
+
+    size_t done = 0;
+    while (done < size && idx < m->n_chunks) {
+        const vcfs_chunk *c = &m->chunks[idx];
+        if (r->fd < 0 || r->idx != idx) {
+            if (r->fd >= 0) {
+                close(r->fd);
+            }
+            r->fd = vcfs_chunk_open(r->root, c);
+            if (r->fd < 0) {
+                int res = r->fd;
+                r->fd = -1;
+                return res;
+            }
+            r->idx = idx;
+        }
+
+        uint64_t in_chunk = offset + done - c->offset;
+        size_t n = c->len - in_chunk;
+        if (n > size - done) {
+            n = size - done;
+        }
+        ssize_t got = pread_full(r->fd, buf + done, n, in_chunk);
+        if (got < 0) {
+            return got;
+        }
+        if ((size_t)got < n) {
+            // The chunk is shorter than the manifest says.
+            return -EIO;
+        }
+        done += n;
+        if (in_chunk + n == c->len) {
+            ++idx;
+        }
+    }
+
+    return done;
+}
+
+void vcfs_chunk_reader_close(vcfs_chunk_reader *r)
+{
+    if (r->fd >= 0) {
+        close(r->fd);
+        r->fd = -1;
+    }
+    vcfs_manifest_free(&r->manifest);
+}
+
+int vcfs_chunk_materialize(const char *root, int manifest_fd, int out_fd)
+{
+    vcfs_chunk_reader r;
+    int res = vcfs_chunk_reader_open(&r, root, manifest_fd);
+    if (res) {
+        return res;
+    }
+
+    char *buf = (char *)malloc(CHUNK_MAX_SIZE);
+    if (buf == NULL) {
+        vcfs_chunk_reader_close(&r);
+        return -ENOMEM;
+    }
+
+    for (size_t i = 0; i < r.manifest.n_chunks && res == 0; ++i) {
+        const vcfs_chunk *c = &r.manifest.chunks[i];
+        ssize_t n = vcfs_chunk_reader_read(&r, buf, c->len, c->offset);
+        if (n < 0) {
+            res = n;
+        } else {
+            res = write_full(out_fd, buf, n);
+        }
+    }
+
+    free(buf);
+    vcfs_chunk_reader_close(&r);
+    return res;
+}
+
+/**
+ * Create `dir` and its parent unless they exist.
+ */
+static int make_dirs(char *dir)
+{
+    char *slash = strrchr(dir, '/');
+    if (mkdir(dir, 0755) == 0 || errno == EEXIST) {
+        return 0;
+    }
+    if (errno != ENOENT || slash == NULL) {
+        return -errno;
+    }
+
+    *slash = '\0';
+    int res = make_dirs(dir);
+    *slash = '/';
+    if (res) {
+        return res;
+    }
+    return mkdir(dir, 0755) == 0 || errno == EEXIST ? 0 : -errno;
+}
+
+/**
+ * Open a temporary file in .vcfs, outside the chunk directory so a file left
+ * behind by a crash is never committed as a chunk.
+ */
+static int open_temp(const char *root, char *path, size_t size)
+{
+    int len = snprintf(path, size, "%s/.vcfs/tmp-XXXXXX", root);
+    if (len < 0 || (size_t)len >= size) {
+        return -ENAMETOOLONG;
+    }
+    int fd = mkostemp(path, O_CLOEXEC);
+    return fd < 0 ? -errno : fd;
+}
+
+/**
+ * Store a chunk unless the repository already has it.
+ *
+ * Returns 1 if it was stored, 0 if it already existed, or a negative errno
+ * value.
+ */
+static int store_chunk(const char *root, const uint8_t hash[VCFS_SHA256_SIZE],
+                       const void *data, size_t len)
+{
+    char path[PATH_MAX];
+    int res = chunk_path(path, sizeof(path), root, hash);
+    if (res) {
+        return res;
+    }
+    if (access(path, F_OK) == 0) {
+        return 0;
+    }
+
+    char *slash = strrchr(path, '/');
+    *slash = '\0';
+    res = make_dirs(path);
+    *slash = '/';
+    if (res) {
+        return res;
+    }
+
+    char tmp[PATH_MAX];
+    int fd = open_temp(root, tmp, sizeof(tmp));
+    if (fd < 0) {
+        return fd;
+    }
+    res = write_full(fd, data, len);
+    if (res == 0 && fchmod(fd, 0644)) {
+        res = -errno;
+    }
+    close(fd);
+    if (res == 0 && rename(tmp, path)) {
+        res = -errno;
+    }
+    if (res) {
+        unlink(tmp);
+        return res;
+    }
+    return 1;
+}
+
+static int make_vcfs_dir(const char *root)
+{
+    char dir[PATH_MAX];
+    int len = snprintf(dir, sizeof(dir), "%s/.vcfs", root);
+    if (len < 0 || (size_t)len >= sizeof(dir)) {
+        return -ENAMETOOLONG;
+    }
+    return make_dirs(dir);
+}
+
+int vcfs_chunk_open_scratch(const char *root)
+{
+    int res = make_vcfs_dir(root);
+    if (res) {
+        return res;
+    }
+
+    char path[PATH_MAX];
+    int fd = open_temp(root, path, sizeof(path));
+    if (fd >= 0) {
+        unlink(path);
+    }
+    return fd;
+}
+
+int vcfs_chunk_store(const char *root, int in_fd, const char *path)
+{
+    pthread_once(&gear_once, gear_init);
+
+    int res = make_vcfs_dir(root);
+    if (res) {
+        return res;
+    }
+
+    // The manifest is built in a temporary file next to the chunks and
+    // renamed over `path` once every chunk it names is in place.
+    char tmp[PATH_MAX];
+    int out_fd = open_temp(root, tmp, sizeof(tmp));
+    if (out_fd < 0) {
+        return out_fd;
+    }
+    FILE *out = fdopen(out_fd, "w");
+    if (out == NULL) {
+        res = -errno;
+        close(out_fd);
+        unlink(tmp);
+        return res;
+    }
+
+    struct stat st;
+    if (fstat(in_fd, &st)) {
+        res = -errno;
+        goto out;
+    }
+    fprintf(out, VCFS_MANIFEST_MAGIC "size %" PRIu64 "\n", (uint64_t)st.st_size);
+
+    // Keep a whole maximum-sized chunk ahead of the cut point at all times.
+    uint8_t *buf = (uint8_t *)malloc(2 * CHUNK_MAX_SIZE);
+    if (buf == NULL) {
+        res = -ENOMEM;
+        goto out;
+    }
+
+    int stored = 0;
+    size_t buf_len = 0;
+    off_t in_off = 0;
+    bool eof = false;
+    while (true) {
+        while (!eof && buf_len < 2 * CHUNK_MAX_SIZE) {
+            ssize_t n = pread_full(in_fd, buf + buf_len, 2 * CHUNK_MAX_SIZE - buf_len, in_off);
+            if (n < 0) {
+                res = n;
+                goto out_buf;
+            }
+            eof = n == 0;
+            buf_len += n;
+            in_off += n;
+        }
+        if (buf_len == 0) {
+            break;
+        }
+
+        size_t cut = find_cut(buf, buf_len);
+
+        vcfs_sha256 ctx;
+        uint8_t hash[VCFS_SHA256_SIZE];
+        vcfs_sha256_init(&ctx);
+        vcfs_sha256_update(&ctx, buf, cut);
+        vcfs_sha256_final(&ctx, hash);
+
+        int n = store_chunk(root, hash, buf, cut);
+        if (n < 0) {
+            res = n;
+            goto out_buf;
+        }
+        stored += n;
+
+        char hex[2 * VCFS_SHA256_SIZE + 1];
+        hash_to_hex(hash, hex);
+        fprintf(out, "%s %zu\n", hex, cut);
+
+        memmove(buf, buf + cut, buf_len - cut);
+        buf_len -= cut;
+    }
+
+    if (in_off != st.st_size) {
+        // Written to while we were reading it; the size line would be wrong.
+        res = -EBUSY;
+        goto out_buf;
+    }
+
+    // Keep the permissions of the file we're replacing, if there is one.
+    if (stat(path, &st) == 0) {
+        fchmod(out_fd, st.st_mode & 07777);
+    } else {
+        fchmod(out_fd, 0644);
+    }
+
+    if (fflush(out) || ferror(out)) {
+        res = -EIO;
+    } else if (rename(tmp, path)) {
+        res = -errno;
+    } else {
+        res = stored;
+    }
+
+out_buf:
+    free(buf);
+out:
+    fclose(out);
+    if (res < 0) {
+        unlink(tmp);
+    }
+    return res;
+}
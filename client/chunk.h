@@ -0,0 +1,127 @@
+#ifndef VCFS_CHUNK_H
+#define VCFS_CHUNK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sha256.h"
+
+/**
+ * Chunked storage for large files.
+ *
+ * A chunked file is committed as a small text manifest in place of its
+ * contents:
+ *
+ *     vcfs-chunked 1
+ *     size <total size>
+ *     <sha256> <length>
+ *     ...
+ *
+ * Each chunk is stored once under .vcfs/chunks/<first two hex digits>/<sha256>
+ * in the repository, so an edit only adds the chunks it changed and git only
+ * transfers those. Chunk boundaries are picked from the content itself (with
+ * a gear rolling hash), so inserting or removing bytes only disturbs the
+ * chunks around the edit rather than shifting every boundary after it.
+ */
+
+#define VCFS_CHUNK_DIR ".vcfs/chunks"
+#define VCFS_MANIFEST_MAGIC "vcfs-chunked 1\n"
+
+typedef struct vcfs_chunk
+{
+    uint8_t     hash[VCFS_SHA256_SIZE];
+    uint64_t    offset;
+    uint32_t    len;
+} vcfs_chunk;
+
+typedef struct vcfs_manifest
+{
+    uint64_t    size;
+    size_t      n_chunks;
+    vcfs_chunk *chunks;
+} vcfs_manifest;
+
+/**
+ * Returns whether the regular file open on `fd` is a manifest, storing the
+ * size of the file it describes in `size` if so. This only reads the header.
+ */
+bool vcfs_manifest_probe(int fd, uint64_t *size);
+
+/**
+ * Returns 0 on success or a negative errno value: -EIO if the manifest is
+ * malformed, including if it lists a chunk which is empty or bigger than any
+ * chunk we write.
+ */
+int vcfs_manifest_load(int fd, vcfs_manifest *m);
+
+void vcfs_manifest_free(vcfs_manifest *m);
+
+/**
+ * Write the path of the file holding chunk `c` below the repository `root`
+ * to `path`. With an empty `root` this is the path within the repository,
+ * with a leading slash.
+ *
+ * Returns 0 on success or a negative errno value.
+ */
+int vcfs_chunk_path(char *path, size_t size, const char *root, const vcfs_chunk *c);
+
+/**
+ * Open the file holding chunk `c` for reading.
+ *
+ * Returns the file descriptor or a negative errno value.
+ */
+int vcfs_chunk_open(const char *root, const vcfs_chunk *c);
+
+/**
+ * Reads a chunked file through its manifest, keeping the chunk most recently
+ * read from open. Not thread safe.
+ */
+typedef struct vcfs_chunk_reader
+{
+    const char     *root;
+    vcfs_manifest   manifest;
+    int             fd;
+    size_t          idx;
+} vcfs_chunk_reader;
+
+/**
+ * Set up `r` to read the manifest open on `manifest_fd`, with chunks found
+ * below the repository `root`, which must outlive the reader.
+ *
+ * Returns 0 on success or a negative errno value.
+ */
+int vcfs_chunk_reader_open(vcfs_chunk_reader *r, const char *root, int manifest_fd);
+
+/**
+ * Returns the number of bytes read or a negative errno value.
+ */
+ssize_t vcfs_chunk_reader_read(vcfs_chunk_reader *r, char *buf, size_t size, off_t offset);
+
+void vcfs_chunk_reader_close(vcfs_chunk_reader *r);
+
+/**
+ * Copy the whole file described by the manifest on `manifest_fd` to `out_fd`.
+ *
+ * Returns 0 on success or a negative errno value.
+ */
+int vcfs_chunk_materialize(const char *root, int manifest_fd, int out_fd);
+
+/**
+ * Open an anonymous scratch file in the repository's .vcfs directory.
+ *
+ * Returns the file descriptor or a negative errno value.
+ */
+int vcfs_chunk_open_scratch(const char *root);
+
+/**
+ * Split the contents of `in_fd` into chunks, store the ones the repository
+ * doesn't have yet and atomically replace `path` with a manifest for them.
+ * The manifest keeps the permissions of the file it replaces.
+ *
+ * Returns the number of new chunks stored or a negative errno value.
+ */
+int vcfs_chunk_store(const char *root, int in_fd, const char *path);
+
+#endif
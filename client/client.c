@@ -10,6 +10,9 @@
 
 #define FUSE_USE_VERSION 26
 
+/* For pipe2() */
+#define _GNU_SOURCE
+
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
@@ -27,200 +30,1482 @@
 #include <dirent.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <poll.h>
+#include <pthread.h>
+#include <spawn.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <netinet/ip.h>
 #include <inttypes.h>
-
-#define LOG(fmt, ...) printf(fmt "\n", ##__VA_ARGS__)
-
-static const char *mount_point;
-static int port;
-static unsigned long ip;
+#include <limits.h>
+#include <stdatomic.h>
+
+#include "chunk.h"
+#include "metacache.h"
+#include "profile.h"
+#include "protocol.h"
+#include "sparse.h"
+#include "trace.h"
+
+// Adjacent writes to a handle are merged in memory up to this many bytes
+// before they are written to the backing file.
+#define VCFS_WRITE_BUFFER_SIZE (256 * 1024)
+
+// Until the server says otherwise.
+#define VCFS_DEFAULT_HEARTBEAT_SECS 5
+// The connection is presumed dead after this many heartbeat intervals of
+// silence from the server.
+#define VCFS_MISSED_HEARTBEATS 3
+#define VCFS_CONNECT_TIMEOUT_SECS 5
+#define VCFS_MAX_BACKOFF_SECS 60
+
+// Most files warmed after a pull or at mount time.
+#define VCFS_PREFETCH_MAX_FILES 256
+
+// Past this many dirty paths a commit just checks the whole tree.
+#define VCFS_MAX_DIRTY_PATHS 1024
+
+extern char **environ;
+
+/**
+ * State shared by every FUSE worker thread. Everything above `lock` is set up
+ * once in main/vcfs_init and is read-only afterwards; everything below it is
+ * protected by `lock`.
+ *
+ * Only the commit worker thread reads the notification socket and runs git
+ * commands which move HEAD (fetch, merge, commit, push). FUSE operations only
+ * touch the backing files through their own handles and hand git work to the
+ * worker, so a slow push never blocks readers and writers on the mount.
+ */
+typedef struct vcfs_state
+{
+    char               *repo_root;
+    size_t              repo_root_len;
+    unsigned long       ip;
+    int                 port;
+    vcfs_sparse         sparse;
+    // For a sparse mount, its sparse-checkout file and the chunks it checks
+    // out, sorted. The chunks are protected by `git_lock`.
+    char               *sparse_file;
+    char              **sparse_chunks;
+    size_t              n_sparse_chunks;
+    // Tracked files which reach this size are stored as chunks; 0 if never.
+    uint64_t            chunk_threshold;
+    // Bytes of likely files to warm after a pull or at mount; 0 disables
+    // recording the access profile too.
+    uint64_t            prefetch_budget;
+    char               *profile_file;
+    char               *meta_file;
+
+    // Which files are read together, used to pick what to prefetch. It has
+    // its own lock.
+    vcfs_profile        profile;
+
+    // Manifest sizes and the dirty set, kept across remounts. It has its own
+    // lock.
+    vcfs_metacache      meta;
+
+    // Whether the repository has any chunked files, so manifests need to be
+    // looked for. Set by main and by the commit worker after a pull.
+    atomic_bool         chunked;
+
+    int                 wakefd[2];
+    pthread_t           worker;
+
+    // Connection to the server, only touched by the commit worker.
+    int                 sockfd;
+    uint64_t            epoch;
+    uint64_t            last_seq;
+    int                 heartbeat_secs;
+    time_t              last_heard;
+    time_t              reconnect_at;
+    int                 backoff_secs;
+    // Whether the files this mount usually reads have been warmed yet.
+    bool                prefetched;
+
+    // Held around git commands which touch the index or the working tree.
+    pthread_mutex_t     git_lock;
+
+    // Handles open for writing, whose buffered writes operations on their
+    // paths must see. Taken before any handle's lock and `git_lock`.
+    pthread_mutex_t     handles_lock;
+    struct vcfs_file_handle *write_handles;
+
+    pthread_mutex_t     lock;
+    pthread_cond_t      commit_done;
+    uint64_t            commit_requested;
+    uint64_t            commit_completed;
+    int                 commit_status;
+    bool                stopping;
+} vcfs_state;
 
 typedef struct vcfs_file_handle
 {
     int fd;
+    DIR *dir;
+
+    // Pending writes covering [wbuf_off, wbuf_off + wbuf_len), protected by
+    // `lock` since the kernel may send requests for one handle concurrently.
+    pthread_mutex_t lock;
+    char *wbuf;
+    size_t wbuf_len;
+    off_t wbuf_off;
+    // First error hit writing back the buffer, reported by the next flush.
+    int wbuf_err;
+
+    // Set for read-only handles on a chunked file, which read straight from
+    // the chunks.
+    vcfs_chunk_reader *chunks;
+    // Backing path of a file to store as chunks once it has been modified:
+    // either a chunked file, in which case `fd` is a private scratch copy of
+    // its contents, or a file which may grow past the threshold. It follows
+    // renames, under `git_lock`, and is only stored to while it is still the
+    // file the handle was opened on, `store_dev` and `store_ino`.
+    char *store_path;
+    dev_t store_dev;
+    ino_t store_ino;
+    bool scratch;
+    bool modified;
+    // Whether the handle was opened for writing, so its path is dirty.
+    bool writable;
+
+    // For handles open for writing, the path it was opened at (updated by
+    // renames) and its place in `write_handles`, protected by
+    // `handles_lock`.
+    char *path;
+    struct vcfs_file_handle *prev;
+    struct vcfs_file_handle *next;
 } vcfs_file_handle;
 
-static char *vcfs_repo_path(const char *path)
+static vcfs_state *vcfs_get_state(void)
 {
-    const char *prefix = getenv("VCFS_PREFIX");
-    if (prefix == NULL) {
-        prefix = "/vcfs";
+    return (vcfs_state *)fuse_get_context()->private_data;
+}
+
+/**
+ * Returns 0 if `path` is part of a sparse mount, or `err` if it is not.
+ * Paths outside the mount are hidden rather than passed through, so the view
+ * is the same whether or not an out-of-scope file happens to exist on disk.
+ */
+static int vcfs_check_scope(const char *path, int err)
+{
+    // .vcfs holds the chunks of chunked files, which are only reached
+    // through their manifests.
+    if (strncmp(path, "/.vcfs", 6) == 0 && (path[6] == '\0' || path[6] == '/')) {
+        return err;
     }
+    return vcfs_sparse_contains(&vcfs_get_state()->sparse, path) ? 0 : err;
+}
+
+static char *vcfs_repo_path(const char *path)
+{
+    vcfs_state *s = vcfs_get_state();
 
-    size_t prefix_len = strlen(prefix);
-    size_t mount_point_len = strlen(mount_point);
     size_t path_len = strlen(path);
 
-    char *rpath = (char *)malloc(prefix_len + mount_point_len + path_len + 1);
+    char *rpath = (char *)malloc(s->repo_root_len + path_len + 1);
     if (rpath == NULL) {
         perror("vcfs_repo_path:malloc");
         abort();
     }
 
-    strcpy(rpath, prefix);
-    strcpy(rpath + prefix_len, mount_point);
-    strcpy(rpath + prefix_len + mount_point_len, path);
-
-    printf("path is : %s \n", rpath);
+    memcpy(rpath, s->repo_root, s->repo_root_len);
+    memcpy(rpath + s->repo_root_len, path, path_len + 1);
 
     return rpath;
 }
 
-void pull_if_needed() {
-    int sockfd = *(int *)(fuse_get_context()->private_data);
+/**
+ * Run `git -C <repo> <args...>` and wait for it to exit. If `out` is not NULL,
+ * all of git's standard output is stored in a NUL-terminated buffer there,
+ * which the caller must free, and its length in `out_len`.
+ *
+ * Returns git's exit status, or -1 if git could not be run. This is safe to
+ * call from any thread, unlike system() and popen().
+ */
+static int vcfs_git_capture(vcfs_state *s, const char *const args[], char **out, size_t *out_len)
+{
+    // Commits may name many paths.
+    size_t n_args = 0;
+    while (args[n_args] != NULL) {
+        ++n_args;
+    }
+    const char **argv = (const char **)malloc((n_args + 4) * sizeof(char *));
+    if (argv == NULL) {
+        perror("vcfs_git_capture:malloc");
+        abort();
+    }
+    argv[0] = "git";
+    argv[1] = "-C";
+    argv[2] = s->repo_root;
+    memcpy(argv + 3, args, (n_args + 1) * sizeof(char *));
+
+    uint64_t start = vcfs_trace_start(TRACE_DEBUG);
+
+    int pipefd[2] = { -1, -1 };
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (out != NULL) {
+        if (pipe2(pipefd, O_CLOEXEC)) {
+            perror("pipe");
+            posix_spawn_file_actions_destroy(&actions);
+            free(argv);
+            return -1;
+        }
+        posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+    }
+
+    pid_t pid;
+    int err = posix_spawnp(&pid, "git", &actions, NULL, (char *const *)argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    free(argv);
+    if (out != NULL) {
+        close(pipefd[1]);
+    }
+    if (err) {
+        errno = err;
+        perror("posix_spawnp git");
+        if (out != NULL) close(pipefd[0]);
+        return -1;
+    }
+
+    if (out != NULL) {
+        // Always read to the end, so git never blocks on a full pipe.
+        size_t len = 0, cap = 256;
+        char *buf = (char *)malloc(cap);
+        ssize_t n;
+        while (buf != NULL && (n = read(pipefd[0], buf + len, cap - 1 - len)) != 0) {
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            len += n;
+            if (len == cap - 1) {
+                cap *= 2;
+                char *grown = (char *)realloc(buf, cap);
+                if (grown == NULL) {
+                    free(buf);
+                }
+                buf = grown;
+            }
+        }
+        close(pipefd[0]);
+        if (buf == NULL) {
+            perror("vcfs_git_capture:malloc");
+            abort();
+        }
+        buf[len] = '\0';
+        *out = buf;
+        if (out_len != NULL) {
+            *out_len = len;
+        }
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            perror("waitpid");
+            if (out != NULL) {
+                free(*out);
+                *out = NULL;
+            }
+            return -1;
+        }
+    }
+
+    int res = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    TRACE_SPAN(TRACE_DEBUG, TRACE_OP_GIT, start, res, args[0]);
+    return res;
+}
+
+/**
+ * Like vcfs_git_capture, but only the first line of git's standard output is
+ * stored in `out` (without the trailing newline), if `out` is not NULL.
+ */
+static int vcfs_git_output(vcfs_state *s, const char *const args[], char *out, size_t out_size)
+{
+    if (out == NULL) {
+        return vcfs_git_capture(s, args, NULL, NULL);
+    }
+
+    char *all = NULL;
+    int res = vcfs_git_capture(s, args, &all, NULL);
+    if (all == NULL) {
+        out[0] = '\0';
+        return res;
+    }
+    all[strcspn(all, "\n")] = '\0';
+    snprintf(out, out_size, "%s", all);
+    free(all);
+    return res;
+}
+
+static int vcfs_git(vcfs_state *s, const char *const args[])
+{
+    return vcfs_git_output(s, args, NULL, 0);
+}
+
+static ssize_t read_full(int fd, void *buf, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, (char *)buf + done, size - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return n;
+        done += n;
+    }
+    return done;
+}
+
+/**
+ * Note whether the repository has any chunked files.
+ */
+static void vcfs_check_chunked(vcfs_state *s)
+{
+    if (atomic_load(&s->chunked)) {
+        return;
+    }
+
+    char dir[PATH_MAX];
+    struct stat st;
+    if (snprintf(dir, sizeof(dir), "%s/" VCFS_CHUNK_DIR, s->repo_root) < (int)sizeof(dir)
+            && stat(dir, &st) == 0) {
+        atomic_store(&s->chunked, true);
+    }
+}
+
+/**
+ * Add the paths of the chunks of the manifest open on `fd` to `chunks`, a
+ * sorted array of `*n_chunks` paths, leaving out those already there.
+ *
+ * Returns 0 on success or a negative errno value.
+ */
+static int vcfs_add_chunk_paths(int fd, char ***chunks, size_t *n_chunks)
+{
+    vcfs_manifest m;
+    int res = vcfs_manifest_load(fd, &m);
+    if (res) {
+        return res;
+    }
+
+    for (size_t i = 0; i < m.n_chunks; ++i) {
+        char path[PATH_MAX];
+        res = vcfs_chunk_path(path, sizeof(path), "", &m.chunks[i]);
+        if (res) {
+            break;
+        }
+
+        size_t lo = 0, hi = *n_chunks;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            int cmp = strcmp((*chunks)[mid], path);
+            if (cmp == 0) {
+                break;
+            }
+            if (cmp < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo < hi) {
+            // Already there, eg shared with another file.
+            continue;
+        }
+
+        char **grown = (char **)realloc(*chunks, (*n_chunks + 1) * sizeof(char *));
+        if (grown == NULL) {
+            res = -ENOMEM;
+            break;
+        }
+        *chunks = grown;
+        char *copy = strdup(path);
+        if (copy == NULL) {
+            res = -ENOMEM;
+            break;
+        }
+        memmove(grown + lo + 1, grown + lo, (*n_chunks - lo) * sizeof(char *));
+        grown[lo] = copy;
+        ++*n_chunks;
+    }
+
+    vcfs_manifest_free(&m);
+    return res;
+}
+
+static void vcfs_free_chunk_paths(char **chunks, size_t n_chunks)
+{
+    for (size_t i = 0; i < n_chunks; ++i) {
+        free(chunks[i]);
+    }
+    free(chunks);
+}
+
+/**
+ * Have a sparse mount check out the chunks of the chunked files it includes,
+ * and no others, working them out again from the manifests it has checked
+ * out. Must be called with `git_lock` held, or before the mount is served.
+ */
+static void vcfs_sparse_refresh(vcfs_state *s)
+{
+    if (s->sparse_file == NULL) {
+        return;
+    }
+
+    char **chunks = NULL;
+    size_t n_chunks = 0;
+    int res = 0;
+
+    // Only look for manifests if there are chunks to find.
+    char tree[128];
+    if (vcfs_git_output(s, (const char *[]){ "rev-parse", "-q", "--verify", "HEAD:" VCFS_CHUNK_DIR, NULL },
+                        tree, sizeof(tree)) == 0) {
+        char *files = NULL;
+        size_t files_len = 0;
+        if (vcfs_git_capture(s, (const char *[]){ "ls-files", "-z", NULL }, &files, &files_len)) {
+            free(files);
+            return;
+        }
+        for (size_t off = 0; off < files_len && res == 0; off += strlen(files + off) + 1) {
+            const char *file = files + off;
+            if (strncmp(file, ".vcfs/", 6) == 0 || !vcfs_sparse_contains(&s->sparse, file)) {
+                continue;
+            }
+            char path[PATH_MAX];
+            if (snprintf(path, sizeof(path), "%s/%s", s->repo_root, file) >= (int)sizeof(path)) {
+                continue;
+            }
+            int fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+            if (fd < 0) {
+                continue;
+            }
+            uint64_t size;
+            if (vcfs_manifest_probe(fd, &size)) {
+                res = vcfs_add_chunk_paths(fd, &chunks, &n_chunks);
+            }
+            close(fd);
+        }
+        free(files);
+    }
+
+    // Checking out fewer chunks than the manifests need would break reads.
+    if (res == 0 && vcfs_sparse_save(&s->sparse, s->sparse_file, chunks, n_chunks)) {
+        res = -errno;
+    }
+    if (res) {
+        errno = -res;
+        perror(s->sparse_file);
+        vcfs_free_chunk_paths(chunks, n_chunks);
+        return;
+    }
+    vcfs_free_chunk_paths(s->sparse_chunks, s->n_sparse_chunks);
+    s->sparse_chunks = chunks;
+    s->n_sparse_chunks = n_chunks;
+
+    vcfs_git(s, (const char *[]){ "sparse-checkout", "reapply", NULL });
+}
+
+/**
+ * Ask the kernel to read ahead up to `budget` bytes of the file open on `fd`.
+ *
+ * Returns the number of bytes requested.
+ */
+static uint64_t vcfs_warm_fd(int fd, uint64_t budget)
+{
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    uint64_t len = (uint64_t)st.st_size < budget ? (uint64_t)st.st_size : budget;
+    posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+    return len;
+}
+
+/**
+ * Warm the page cache for the files the access profile says are likely to be
+ * read next: the changed files which are read here and what is usually read
+ * after them, or the most read files if `n_changed` is 0. At most
+ * `prefetch_budget` bytes are read ahead. Must be called from the commit
+ * worker.
+ */
+static void vcfs_prefetch(vcfs_state *s, const char *const *changed, size_t n_changed)
+{
+    if (s->prefetch_budget == 0) {
+        return;
+    }
+
+    uint64_t start = vcfs_trace_start(TRACE_INFO);
+
+    char *paths[VCFS_PREFETCH_MAX_FILES];
+    size_t n = vcfs_profile_predict(&s->profile, changed, n_changed, paths, VCFS_PREFETCH_MAX_FILES);
+
+    uint64_t budget = s->prefetch_budget;
+    for (size_t i = 0; i < n; ++i) {
+        char rpath[PATH_MAX];
+        int fd = -1;
+        if (budget > 0 && vcfs_sparse_contains(&s->sparse, paths[i])
+                && snprintf(rpath, sizeof(rpath), "%s%s", s->repo_root, paths[i]) < (int)sizeof(rpath)) {
+            fd = open(rpath, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+        }
+        free(paths[i]);
+        if (fd < 0) {
+            continue;
+        }
+
+        uint64_t size;
+        if (atomic_load(&s->chunked) && vcfs_manifest_probe(fd, &size)) {
+            // The data is in the chunks.
+            vcfs_manifest m;
+            if (vcfs_manifest_load(fd, &m) == 0) {
+                for (size_t j = 0; j < m.n_chunks && budget > 0; ++j) {
+                    int chunk_fd = vcfs_chunk_open(s->repo_root, &m.chunks[j]);
+                    if (chunk_fd >= 0) {
+                        budget -= vcfs_warm_fd(chunk_fd, budget);
+                        close(chunk_fd);
+                    }
+                }
+                vcfs_manifest_free(&m);
+            }
+        } else {
+            budget -= vcfs_warm_fd(fd, budget);
+        }
+        close(fd);
+    }
+
+    TRACE_SPAN(TRACE_INFO, TRACE_OP_PREFETCH, start, s->prefetch_budget - budget, NULL);
+}
+
+/**
+ * Prefetch what is likely to be read now that HEAD has moved on from `old`.
+ */
+static void vcfs_prefetch_changes(vcfs_state *s, const char *old)
+{
+    char *names = NULL;
+    size_t len = 0;
+    if (vcfs_git_capture(s, (const char *[]){ "diff", "--name-only", "-z", "--no-renames", old, "HEAD", "--", NULL },
+                         &names, &len) || names == NULL) {
+        free(names);
+        return;
+    }
+
+    // The profile knows paths as the mount sees them, with a leading slash.
+    size_t n = 0, cap = 0;
+    char **changed = NULL;
+    for (char *name = names; name < names + len; name += strlen(name) + 1) {
+        if (n == cap) {
+            cap = cap ? 2 * cap : 64;
+            char **grown = (char **)realloc(changed, cap * sizeof(char *));
+            if (grown == NULL) {
+                break;
+            }
+            changed = grown;
+        }
+        if (asprintf(&changed[n], "/%s", name) < 0) {
+            break;
+        }
+        ++n;
+    }
+    free(names);
+
+    if (n > 0) {
+        vcfs_prefetch(s, (const char *const *)changed, n);
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        free(changed[i]);
+    }
+    free(changed);
+}
+
+/**
+ * Bring the metadata cache loaded at mount up to date with the checkout,
+ * which may have moved since it was saved.
+ */
+static void vcfs_reconcile_meta(vcfs_state *s)
+{
+    char head[VCFS_META_HEAD_SIZE];
+    if (s->meta.head[0] == '\0'
+            || vcfs_git_output(s, (const char *[]){ "rev-parse", "HEAD", NULL }, head, sizeof(head))
+            || strcmp(head, s->meta.head) == 0) {
+        return;
+    }
+
+    // Something else moved HEAD, so it may have changed the tree too.
+    vcfs_meta_dirty_unknown(&s->meta);
+
+    char *changed = NULL;
+    size_t changed_len = 0;
+    if (vcfs_git_capture(s, (const char *[]){ "diff", "--name-only", "-z", "--no-renames",
+                                              s->meta.head, "HEAD", "--", NULL },
+                         &changed, &changed_len)) {
+        // Can't tell what changed; the inode, size and mtime checks will
+        // have to do.
+        free(changed);
+        return;
+    }
+    for (size_t off = 0; off < changed_len; off += strlen(changed + off) + 1) {
+        char *path;
+        if (asprintf(&path, "/%s", changed + off) >= 0) {
+            vcfs_meta_forget(&s->meta, path);
+            free(path);
+        }
+    }
+    free(changed);
+}
+
+/**
+ * Fetch and merge the current branch. Must be called from the commit worker.
+ */
+static void vcfs_pull(vcfs_state *s)
+{
+    uint64_t start = vcfs_trace_start(TRACE_INFO);
+
+    int res = vcfs_git(s, (const char *[]){ "fetch", NULL });
+    if (res) {
+        // offline mode
+        TRACE(TRACE_ERROR, TRACE_OP_PULL, res);
+        return;
+    }
+
+    // Remember where we were, to see what the merge changes.
+    char old[128];
+    if (s->prefetch_budget == 0
+            || vcfs_git_output(s, (const char *[]){ "rev-parse", "HEAD", NULL }, old, sizeof(old))) {
+        old[0] = '\0';
+    }
+
+    pthread_mutex_lock(&s->git_lock);
+    if (vcfs_git(s, (const char *[]){ "merge", "-m", "automated merge", NULL })) {
+        // merge conflict
+        if (vcfs_git(s, (const char *[]){ "merge", "--abort", NULL })) {
+            TRACE(TRACE_ERROR, TRACE_OP_MERGE_CONFLICT, -1);
+            pthread_mutex_unlock(&s->git_lock);
+            return;
+        }
+
+        char branch[32];
+        snprintf(branch, sizeof(branch), "%"PRIu64, (uint64_t)time(NULL));
+        if (vcfs_git(s, (const char *[]){ "checkout", "-b", branch, NULL })) {
+            fprintf(stderr, "new branch creation failure\n");
+            abort();
+        }
+        if (vcfs_git(s, (const char *[]){ "push", "-u", "origin", branch, NULL })) {
+            fprintf(stderr, "push failure\n");
+            abort();
+        }
+
+        // Switched to a new branch; the user resolves the conflict when possible.
+        TRACE_STR(TRACE_INFO, TRACE_OP_MERGE_CONFLICT, 0, branch);
+        old[0] = '\0';
+    }
+    // The merge may have brought in manifests which need other chunks.
+    vcfs_sparse_refresh(s);
+    pthread_mutex_unlock(&s->git_lock);
+
+    // Someone else may have started chunking files.
+    vcfs_check_chunked(s);
+
+    TRACE_SPAN(TRACE_INFO, TRACE_OP_PULL, start, 0, NULL);
+
+    if (old[0] != '\0') {
+        vcfs_prefetch_changes(s, old);
+        vcfs_profile_save(&s->profile, s->profile_file);
+    }
+}
+
+/**
+ * Drop the connection to the server and schedule a reconnect, backing off
+ * exponentially while the server stays unreachable.
+ */
+static void vcfs_disconnect(vcfs_state *s)
+{
+    if (s->sockfd >= 0) {
+        TRACE(TRACE_ERROR, TRACE_OP_DISCONNECT, s->sockfd);
+        close(s->sockfd);
+        s->sockfd = -1;
+    }
+
+    s->reconnect_at = time(NULL) + s->backoff_secs;
+    s->backoff_secs *= 2;
+    if (s->backoff_secs > VCFS_MAX_BACKOFF_SECS) {
+        s->backoff_secs = VCFS_MAX_BACKOFF_SECS;
+    }
+}
+
+/**
+ * Connect to the server and say hello, resuming from the last notification
+ * we saw. Must be called from the commit worker.
+ */
+static void vcfs_connect(vcfs_state *s)
+{
+    s->sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (s->sockfd < 0) {
+        perror("socket");
+        vcfs_disconnect(s);
+        return;
+    }
+
+    struct sockaddr_in hookaddr = {0};
+    hookaddr.sin_family = AF_INET;
+    hookaddr.sin_port = htons(s->port);
+    hookaddr.sin_addr.s_addr = htonl(s->ip);
+
+    // Don't let an unreachable server hold up the worker for long.
+    if (connect(s->sockfd, (struct sockaddr *) &hookaddr, sizeof(hookaddr)) < 0) {
+        struct pollfd pfd = { .fd = s->sockfd, .events = POLLOUT };
+        int err = errno;
+        socklen_t err_len = sizeof(err);
+        if (err != EINPROGRESS || poll(&pfd, 1, VCFS_CONNECT_TIMEOUT_SECS * 1000) <= 0
+                || getsockopt(s->sockfd, SOL_SOCKET, SO_ERROR, &err, &err_len) || err) {
+            vcfs_disconnect(s);
+            return;
+        }
+    }
+
+    // Reads happen only once poll says data is there, but a frame may still
+    // arrive in pieces; never wait forever for the rest of one.
+    int flags = fcntl(s->sockfd, F_GETFL, 0);
+    fcntl(s->sockfd, F_SETFL, flags & ~O_NONBLOCK);
+    struct timeval tv = { .tv_sec = VCFS_CONNECT_TIMEOUT_SECS };
+    setsockopt(s->sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(s->sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    char hello[VCFS_FRAME_HEADER_SIZE + 2 * sizeof(uint64_t)];
+    size_t off = vcfs_put_frame_header(hello, VCFS_MSG_HELLO, 2 * sizeof(uint64_t));
+    vcfs_put_u64(hello + off, s->epoch);
+    vcfs_put_u64(hello + off + sizeof(uint64_t), s->last_seq);
+    if (write(s->sockfd, hello, sizeof(hello)) != sizeof(hello)) {
+        vcfs_disconnect(s);
+        return;
+    }
+
+    s->last_heard = time(NULL);
+    TRACE(TRACE_INFO, TRACE_OP_CONNECT, s->last_seq);
+}
+
+/**
+ * Pull if a notification is for our branch and names a commit we don't
+ * already have.
+ */
+static void vcfs_handle_notify(vcfs_state *s, const char *buf, size_t size)
+{
+    char branch[256];
+    if (vcfs_git_output(s, (const char *[]){ "rev-parse", "--abbrev-ref", "HEAD", NULL },
+                        branch, sizeof(branch))) {
+        TRACE(TRACE_ERROR, TRACE_OP_NOTIFY_SKIP, -1);
+        return;
+    }
+
+    // The payload is the branch name, optionally followed by the new SHA.
+    const char *space = memchr(buf, ' ', size);
+    size_t name_len = space ? (size_t)(space - buf) : size;
+
+    size_t branch_len = strlen(branch);
+    if (name_len != branch_len || strncmp(branch, buf, name_len) != 0) {
+        TRACE_STRN(TRACE_DEBUG, TRACE_OP_NOTIFY_SKIP, size, buf, size);
+        return;
+    }
+
+    // Our own pushes come back to us too; there's nothing to fetch if the
+    // pushed commit is already in our history.
+    char sha[65];
+    size_t sha_len = space ? size - name_len - 1 : 0;
+    if (sha_len > 0 && sha_len < sizeof(sha)) {
+        memcpy(sha, space + 1, sha_len);
+        sha[sha_len] = '\0';
+        if (vcfs_git(s, (const char *[]){ "merge-base", "--is-ancestor", sha, "HEAD", NULL }) == 0) {
+            TRACE_STR(TRACE_DEBUG, TRACE_OP_NOTIFY_SKIP, 0, sha);
+            return;
+        }
+    }
+
+    vcfs_pull(s);
+}
+
+/**
+ * Read one message from the server and act on it. Must be called from the
+ * commit worker.
+ */
+static void vcfs_handle_message(vcfs_state *s)
+{
+    char buf[VCFS_MAX_FRAME_SIZE];
+    if (read_full(s->sockfd, buf, VCFS_FRAME_HEADER_SIZE) != VCFS_FRAME_HEADER_SIZE) {
+        vcfs_disconnect(s);
+        return;
+    }
+    uint32_t size = vcfs_get_u32(buf) - 1;
+    int type = buf[sizeof(uint32_t)];
+    if (size > sizeof(buf) || read_full(s->sockfd, buf, size) != size) {
+        vcfs_disconnect(s);
+        return;
+    }
 
-    char *branch = NULL;
-    FILE *branch_output = popen("git branch | grep \\* | awk '{ print $2 }'", "r");
+    s->last_heard = time(NULL);
 
-    size_t line_cap;
-    ssize_t branch_len = getline(&branch, &line_cap, branch_output);
-    if (branch_len < 0) {
-        perror("getline");
+    if (size < sizeof(uint64_t)) {
         return;
     }
+    uint64_t seq = vcfs_get_u64(buf);
+
+    switch (type) {
+    case VCFS_MSG_WELCOME:
+        if (size < 2 * sizeof(uint64_t) + sizeof(uint32_t)) {
+            break;
+        }
+        s->backoff_secs = 1;
+        s->heartbeat_secs = vcfs_get_u32(buf + 2 * sizeof(uint64_t));
+        if (s->epoch == 0) {
+            // First connection of this mount: pushes made while we were
+            // unmounted or couldn't reach the server were never notified, so
+            // catch up on them. This is a no-op fetch if we are up to date.
+            s->last_seq = vcfs_get_u64(buf + sizeof(uint64_t));
+            vcfs_pull(s);
+        } else if (seq != s->epoch) {
+            // The server restarted, so our sequence numbers mean nothing to
+            // it. The RESET which follows will find us already caught up.
+            s->last_seq = vcfs_get_u64(buf + sizeof(uint64_t));
+            TRACE(TRACE_INFO, TRACE_OP_RESET, s->last_seq);
+            vcfs_pull(s);
+        }
+        s->epoch = seq;
+        break;
+
+    case VCFS_MSG_NOTIFY:
+        if (seq <= s->last_seq) {
+            // Already seen, eg replayed across a reconnect.
+            break;
+        }
+        s->last_seq = seq;
+        vcfs_handle_notify(s, buf + sizeof(uint64_t), size - sizeof(uint64_t));
+        break;
+
+    case VCFS_MSG_RESET:
+        // We fell off the end of the server's replay log: fetch everything.
+        if (seq != s->last_seq) {
+            s->last_seq = seq;
+            TRACE(TRACE_INFO, TRACE_OP_RESET, seq);
+            vcfs_pull(s);
+        }
+        break;
+
+    case VCFS_MSG_HEARTBEAT:
+        TRACE(TRACE_DEBUG, TRACE_OP_HEARTBEAT, seq);
+        break;
+    }
+}
+
+/**
+ * Handle any messages which have already arrived, without blocking.
+ */
+static void vcfs_drain_notifications(vcfs_state *s)
+{
+    while (s->sockfd >= 0) {
+        struct pollfd pfd = { .fd = s->sockfd, .events = POLLIN };
+        if (poll(&pfd, 1, 0) <= 0) {
+            return;
+        }
+        vcfs_handle_message(s);
+    }
+}
+
+/**
+ * Commit whatever differs from HEAD in the whole tree. Must be called with
+ * `git_lock` held.
+ *
+ * Returns 1 if a commit was made, 0 if there was nothing to commit, or a
+ * negative errno value.
+ */
+static int vcfs_commit_all(vcfs_state *s)
+{
+    if (vcfs_git(s, (const char *[]){ "diff-index", "--quiet", "HEAD", "--", NULL }) == 0) {
+        return 0;
+    }
+    if (vcfs_git(s, (const char *[]){ "commit", "-am", "automated commit", NULL })) {
+        return -EIO;
+    }
+    return 1;
+}
+
+/**
+ * Commit whatever differs from HEAD among `paths`, and any chunks added for
+ * them, leaving the rest of the tree alone. Must be called with `git_lock`
+ * held.
+ *
+ * Returns 1 if a commit was made, 0 if there was nothing to commit, or a
+ * negative errno value.
+ */
+static int vcfs_commit_paths(vcfs_state *s, char *const *paths, size_t n_paths)
+{
+    bool chunked = atomic_load(&s->chunked);
+    if (n_paths == 0 && !chunked) {
+        return 0;
+    }
+
+    int res = -EIO;
+    char **specs = (char **)calloc(n_paths + 1, sizeof(char *));
+    const char **args = (const char **)malloc((n_paths + 8) * sizeof(char *));
+    char *changed = NULL;
+    size_t changed_len = 0, n_changed = 0;
+    if (specs == NULL || args == NULL) {
+        goto out;
+    }
+
+    size_t argc = 0;
+    args[argc++] = "diff-index";
+    args[argc++] = "--name-only";
+    args[argc++] = "-z";
+    args[argc++] = "HEAD";
+    args[argc++] = "--";
+    if (chunked) {
+        args[argc++] = VCFS_CHUNK_DIR;
+    }
+    for (size_t i = 0; i < n_paths; ++i) {
+        if (asprintf(&specs[i], ":(literal)%s", paths[i]) < 0) {
+            specs[i] = NULL;
+            goto out;
+        }
+        args[argc++] = specs[i];
+    }
+    args[argc] = NULL;
+
+    if (vcfs_git_capture(s, args, &changed, &changed_len)) {
+        goto out;
+    }
+
+    for (size_t off = 0; off < changed_len; off += strlen(changed + off) + 1) {
+        ++n_changed;
+    }
+    if (n_changed == 0) {
+        res = 0;
+        goto out;
+    }
+
+    // Only commit the paths which changed: a dirty path may since have
+    // become untracked, and naming one of those fails the commit.
+    for (size_t i = 0; i < n_paths; ++i) {
+        free(specs[i]);
+    }
+    free(specs);
+    free(args);
+    specs = (char **)calloc(n_changed + 1, sizeof(char *));
+    args = (const char **)malloc((n_changed + 8) * sizeof(char *));
+    n_paths = n_changed;
+    if (specs == NULL || args == NULL) {
+        goto out;
+    }
+
+    argc = 0;
+    args[argc++] = "commit";
+    args[argc++] = "-m";
+    args[argc++] = "automated commit";
+    args[argc++] = "--";
+    size_t i = 0;
+    for (size_t off = 0; off < changed_len; off += strlen(changed + off) + 1, ++i) {
+        if (asprintf(&specs[i], ":(literal)%s", changed + off) < 0) {
+            specs[i] = NULL;
+            goto out;
+        }
+        args[argc++] = specs[i];
+    }
+    args[argc] = NULL;
+
+    res = vcfs_git(s, args) ? -EIO : 1;
 
-    uint32_t size;
-    while (read(sockfd, &size, sizeof(size)) > 0) {
-        size = ntohl(size);
+out:
+    if (specs != NULL) {
+        for (size_t i = 0; i < n_paths; ++i) {
+            free(specs[i]);
+        }
+    }
+    free(specs);
+    free(args);
+    free(changed);
+    return res;
+}
+
+/**
+ * Commit any changes in the working tree and push them. Must be called from
+ * the commit worker.
+ *
+ * Only the paths in the dirty set are looked at, unless it is unknown or too
+ * big to be worth it.
+ *
+ * Returns 0 on success or a negative errno value.
+ */
+static int vcfs_commit(vcfs_state *s)
+{
+    char **dirty = NULL;
+    ssize_t n_dirty = vcfs_meta_take_dirty(&s->meta, VCFS_MAX_DIRTY_PATHS, &dirty);
+
+    pthread_mutex_lock(&s->git_lock);
+    if (atomic_load(&s->chunked)) {
+        // New chunks are untracked files, which commit -a would leave out.
+        // Chunks are only written for tracked files, so this never shares
+        // anything that wasn't shared already. A sparse mount leaves most
+        // chunks out, which git add complains about without --sparse.
+        if (s->sparse_file != NULL) {
+            vcfs_git(s, (const char *[]){ "add", "--sparse", "--", VCFS_CHUNK_DIR, NULL });
+        } else {
+            vcfs_git(s, (const char *[]){ "add", "--", VCFS_CHUNK_DIR, NULL });
+        }
+    }
+    int res = n_dirty < 0 ? vcfs_commit_all(s) : vcfs_commit_paths(s, dirty, n_dirty);
+    pthread_mutex_unlock(&s->git_lock);
+
+    if (res < 0) {
+        // Whatever was dirty still is.
+        if (n_dirty < 0) {
+            vcfs_meta_dirty_unknown(&s->meta);
+        }
+        for (ssize_t i = 0; i < n_dirty; ++i) {
+            vcfs_meta_mark_dirty(&s->meta, dirty[i]);
+        }
+    }
+    for (ssize_t i = 0; i < n_dirty; ++i) {
+        free(dirty[i]);
+    }
+    free(dirty);
+
+    if (res < 0) {
+        return res;
+    }
+
+    vcfs_drain_notifications(s);
+
+    if (res > 0 && vcfs_git(s, (const char *[]){ "push", NULL })) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static void vcfs_wake_worker(vcfs_state *s)
+{
+    char c = 0;
+    if (write(s->wakefd[1], &c, 1) < 0 && errno != EAGAIN) {
+        perror("wake worker");
+    }
+}
+
+/**
+ * Ask the commit worker to commit and push the working tree.
+ *
+ * Returns a ticket which can be passed to vcfs_wait_commit.
+ */
+static uint64_t vcfs_request_commit(vcfs_state *s)
+{
+    pthread_mutex_lock(&s->lock);
+    uint64_t ticket = ++s->commit_requested;
+    pthread_mutex_unlock(&s->lock);
+
+    vcfs_wake_worker(s);
+    return ticket;
+}
+
+/**
+ * Block until the commit identified by `ticket` (or a later one) has finished.
+ *
+ * Returns the status of that commit.
+ */
+static int vcfs_wait_commit(vcfs_state *s, uint64_t ticket)
+{
+    pthread_mutex_lock(&s->lock);
+    while (s->commit_completed < ticket) {
+        pthread_cond_wait(&s->commit_done, &s->lock);
+    }
+    int res = s->commit_status;
+    pthread_mutex_unlock(&s->lock);
+    return res;
+}
+
+/**
+ * The commit worker. This is the only thread which reads from the server or
+ * runs git commands that move HEAD, so git work is serialized here while FUSE
+ * worker threads keep serving data operations.
+ */
+static void *vcfs_worker(void *arg)
+{
+    vcfs_state *s = (vcfs_state *)arg;
+
+    pthread_mutex_lock(&s->lock);
+    while (true) {
+        if (s->commit_completed < s->commit_requested) {
+            // Every request made before we start is satisfied by this commit.
+            uint64_t target = s->commit_requested;
+            pthread_mutex_unlock(&s->lock);
+
+            uint64_t start = vcfs_trace_start(TRACE_INFO);
+            int res = vcfs_commit(s);
+            TRACE_SPAN(TRACE_INFO, TRACE_OP_COMMIT, start, res, NULL);
+
+            pthread_mutex_lock(&s->lock);
+            s->commit_completed = target;
+            s->commit_status = res;
+            pthread_cond_broadcast(&s->commit_done);
+            continue;
+        }
+        if (s->stopping) {
+            // Pending commits are flushed above before we exit.
+            break;
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        // Wake up in time to reconnect, or to notice that the server has
+        // missed several heartbeats.
+        time_t now = time(NULL);
+        time_t deadline = s->sockfd >= 0
+            ? s->last_heard + VCFS_MISSED_HEARTBEATS * s->heartbeat_secs
+            : s->reconnect_at;
+        int timeout_ms = deadline > now ? (deadline - now) * 1000 : 0;
+
+        struct pollfd pfds[2] = {
+            { .fd = s->wakefd[0], .events = POLLIN },
+            { .fd = s->sockfd,    .events = POLLIN },
+        };
+        if (poll(pfds, s->sockfd >= 0 ? 2 : 1, timeout_ms) < 0 && errno != EINTR) {
+            perror("poll");
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            char drain[64];
+            while (read(s->wakefd[0], drain, sizeof(drain)) > 0);
+        }
+        if (s->sockfd >= 0 && pfds[1].revents) {
+            vcfs_handle_message(s);
+        }
+
+        now = time(NULL);
+        if (s->sockfd >= 0 && now >= s->last_heard + VCFS_MISSED_HEARTBEATS * s->heartbeat_secs) {
+            vcfs_disconnect(s);
+        } else if (s->sockfd < 0 && now >= s->reconnect_at) {
+            vcfs_connect(s);
+        }
+
+        // Warm what this mount usually reads before anyone asks for it, once
+        // the first pull has brought it up to date or the server turns out
+        // to be unreachable.
+        if (!s->prefetched && (s->epoch != 0 || s->sockfd < 0)) {
+            s->prefetched = true;
+            vcfs_prefetch(s, NULL, 0);
+        }
+
+        pthread_mutex_lock(&s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+static void * vcfs_init(struct fuse_conn_info *conn)
+{
+    vcfs_state *s = vcfs_get_state();
+
+    vcfs_trace_init("client");
+
+#ifdef FUSE_CAP_BIG_WRITES
+    // Without this the kernel splits every write into 4 KiB requests.
+    if (conn->capable & FUSE_CAP_BIG_WRITES) {
+        conn->want |= FUSE_CAP_BIG_WRITES;
+    }
+#else
+    (void) conn;
+#endif
+
+    // The worker connects to the server (and keeps retrying) on its own, so
+    // the mount works offline if the server is unreachable.
+    s->sockfd = -1;
+    s->reconnect_at = 0;
+    s->backoff_secs = 1;
+    s->heartbeat_secs = VCFS_DEFAULT_HEARTBEAT_SECS;
+
+    if (pipe2(s->wakefd, O_NONBLOCK | O_CLOEXEC)) {
+        perror("pipe");
+        abort();
+    }
+
+    pthread_mutex_init(&s->git_lock, NULL);
+    pthread_mutex_init(&s->handles_lock, NULL);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->commit_done, NULL);
+
+    // Threads do not survive fuse_main daemonizing, so start the worker here.
+    if (pthread_create(&s->worker, NULL, vcfs_worker, s)) {
+        perror("pthread_create");
+        abort();
+    }
+
+    return s;
+}
+
+static void vcfs_destroy(void* private_data)
+{
+    vcfs_state *s = (vcfs_state *)private_data;
+
+    pthread_mutex_lock(&s->lock);
+    s->stopping = true;
+    pthread_mutex_unlock(&s->lock);
+    vcfs_wake_worker(s);
+    pthread_join(s->worker, NULL);
+
+    if (s->sockfd >= 0) close(s->sockfd);
+    close(s->wakefd[0]);
+    close(s->wakefd[1]);
+    pthread_cond_destroy(&s->commit_done);
+    pthread_mutex_destroy(&s->lock);
+    pthread_mutex_destroy(&s->git_lock);
+    pthread_mutex_destroy(&s->handles_lock);
+
+    if (s->prefetch_budget) {
+        vcfs_profile_save(&s->profile, s->profile_file);
+    }
+
+    char head[VCFS_META_HEAD_SIZE];
+    if (vcfs_git_output(s, (const char *[]){ "rev-parse", "HEAD", NULL }, head, sizeof(head)) == 0
+            && vcfs_meta_save(&s->meta, s->meta_file, head)) {
+        perror(s->meta_file);
+    }
+
+    vcfs_trace_shutdown();
+}
+
+/**
+ * Write out any buffered data for `fh`. Must be called with `fh->lock` held.
+ *
+ * Returns 0 on success or a negative errno value. Errors stay pending on the
+ * handle until they are reported by vcfs_flush_handle.
+ */
+static int vcfs_flush_locked(vcfs_file_handle *fh)
+{
+    size_t done = 0;
+    while (done < fh->wbuf_len) {
+        ssize_t n = pwrite(fh->fd, fh->wbuf + done, fh->wbuf_len - done, fh->wbuf_off + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (fh->wbuf_err == 0) {
+                fh->wbuf_err = n < 0 ? -errno : -EIO;
+            }
+            break;
+        }
+        done += n;
+    }
+    fh->wbuf_len = 0;
+
+    return fh->wbuf_err;
+}
+
+static int vcfs_flush_handle(vcfs_file_handle *fh)
+{
+    pthread_mutex_lock(&fh->lock);
+    int res = vcfs_flush_locked(fh);
+    fh->wbuf_err = 0;
+    pthread_mutex_unlock(&fh->lock);
+    return res;
+}
 
-        char * buf = (char *) malloc(size);
-        if (buf == NULL) {
-            perror("malloc");
-            abort();
-        }
-        if (read(sockfd, buf, size) != size) {
-            perror("read");
-            abort();
+/**
+ * Write out the buffered writes of every handle open for writing at `path`,
+ * so an operation on the path sees them. Errors stay pending on the
+ * handles.
+ */
+static void vcfs_flush_path(vcfs_state *s, const char *path)
+{
+    pthread_mutex_lock(&s->handles_lock);
+    for (vcfs_file_handle *fh = s->write_handles; fh != NULL; fh = fh->next) {
+        if (strcmp(fh->path, path) == 0) {
+            pthread_mutex_lock(&fh->lock);
+            vcfs_flush_locked(fh);
+            pthread_mutex_unlock(&fh->lock);
         }
+    }
+    pthread_mutex_unlock(&s->handles_lock);
+}
 
-        if (branch[branch_len-1] == '\n') {
-            --branch_len;
+/**
+ * Note that `from` was renamed to `to`, for handles open at or below it.
+ * Must be called with `handles_lock` and `git_lock` held.
+ */
+static void vcfs_rename_handles(vcfs_state *s, const char *from, const char *to)
+{
+    size_t from_len = strlen(from);
+    for (vcfs_file_handle *fh = s->write_handles; fh != NULL; fh = fh->next) {
+        if (strncmp(fh->path, from, from_len) != 0
+                || (fh->path[from_len] != '\0' && fh->path[from_len] != '/')) {
+            continue;
         }
-        if (size != branch_len || strncmp(branch, buf, size) != 0) {
-            LOG("on branch with length %d", (int)branch_len);
-            LOG("on branch %.*s", (int)branch_len, branch);
-            LOG("skipping branch with length %d", (int)size);
-            LOG("skipping branch %.*s", (int)size, buf);
+        char *renamed;
+        if (asprintf(&renamed, "%s%s", to, fh->path + from_len) < 0) {
             continue;
         }
-
-        printf("need to pull %.*s\n", size, buf);
-        free(buf);
-
-        if (system("git fetch")) {
-            printf("failed git pull due to offline mode\n");
-        } else if (system("git merge -m \"automated merge\"")) {
-            // merge conflict
-            if (system("git merge --abort")) {
-                printf("merge abort error\n");
-                break;
-            }
-
-            uint64_t timestamp = time(NULL);
-            char git_cmd[50];
-            sprintf(git_cmd, "git checkout -b %"PRIu64, timestamp);
-            if (system(git_cmd)) {
-                printf("new branch creation failure\n");
-                abort();
+        free(fh->path);
+        fh->path = renamed;
+
+        if (fh->store_path != NULL) {
+            char *store_path;
+            if (asprintf(&store_path, "%s%s", s->repo_root, renamed) >= 0) {
+                free(fh->store_path);
+                fh->store_path = store_path;
             }
-            sprintf(git_cmd, "git push -u origin %"PRIu64, timestamp);
-            if (system(git_cmd)) {
-                printf("push failure\n");
-                abort();
-            }
-
-            LOG("Merge conflict. Switching to new branch. Resolve conflict when possible");
         }
     }
-    free(branch);
-    if (errno == EWOULDBLOCK || errno == EAGAIN) {
-        return;
-    } else {
-        // offline mode
-        return;
-    }
 }
 
-static void * vcfs_init(struct fuse_conn_info *conn)
+/**
+ * Store the contents of `fd` as chunks, with a manifest at `rpath`. Must be
+ * called with `git_lock` held, so the commit worker doesn't pick up the
+ * manifest before the chunks.
+ *
+ * Returns 0 on success or a negative errno value.
+ */
+static int vcfs_store_chunks(vcfs_state *s, int fd, const char *rpath)
 {
-    (void) conn;
-    char * path = vcfs_repo_path("");
-    if (chdir(path)) {
-        perror("change path");
-        abort();
-    }
-    free(path);
+    uint64_t start = vcfs_trace_start(TRACE_INFO);
 
-    int * sockfd = (int *) malloc(sizeof(int));
-    if (sockfd == NULL) {
-        perror("malloc fail");
-        abort();
+    int res = vcfs_chunk_store(s->repo_root, fd, rpath);
+    if (res >= 0) {
+        atomic_store(&s->chunked, true);
     }
-    *sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (*sockfd < 0) {
-        perror("socket");
-        abort();
+
+    if (res >= 0 && s->sparse_file != NULL) {
+        // git won't add the new chunks unless the mount checks them out.
+        int manifest = open(rpath, O_RDONLY | O_CLOEXEC);
+        if (manifest >= 0) {
+            if (vcfs_add_chunk_paths(manifest, &s->sparse_chunks, &s->n_sparse_chunks) == 0
+                    && vcfs_sparse_save(&s->sparse, s->sparse_file, s->sparse_chunks, s->n_sparse_chunks)) {
+                perror(s->sparse_file);
+            }
+            close(manifest);
+        }
     }
 
-    struct sockaddr_in hookaddr = {0};
-    hookaddr.sin_family = AF_INET;
-    hookaddr.sin_port = htons(port);
-    hookaddr.sin_addr.s_addr = htonl(ip);
+    TRACE_SPAN(TRACE_INFO, TRACE_OP_CHUNK_STORE, start, res, rpath + s->repo_root_len);
+    return res < 0 ? res : 0;
+}
 
-    if (connect(*sockfd, (struct sockaddr *) &hookaddr, sizeof(hookaddr)) < 0) {
-        perror("hook connection");
-        abort();
+/**
+ * Store a modified handle's contents as chunks if it is a chunked file, or
+ * a tracked file which has reached the threshold. Must be called with
+ * `fh->lock` held and the write buffer flushed.
+ *
+ * Returns 0 on success or a negative errno value.
+ */
+static int vcfs_store_handle(vcfs_state *s, vcfs_file_handle *fh)
+{
+    // Whether there is a store path, without racing with renames of it.
+    if (!fh->writable || !fh->modified || !(fh->scratch || s->chunk_threshold)) {
+        return 0;
     }
 
-    // make socket non blocking
-    int flags = fcntl(*sockfd, F_GETFL, 0);
-    if (flags == -1) abort();
-    flags |= O_NONBLOCK;
-    if (fcntl(*sockfd, F_SETFL, flags)) abort();
+    struct stat st;
+    if (!fh->scratch && (fstat(fh->fd, &st) || (uint64_t)st.st_size < s->chunk_threshold)) {
+        return 0;
+    }
 
-    return sockfd;
-}
+    int res = 0;
+    pthread_mutex_lock(&s->git_lock);
+    if (fh->store_path == NULL) {
+        goto out;
+    }
+    // If the file was unlinked, or replaced by a rename, since the handle was
+    // opened, its contents are no longer what the path holds.
+    if (lstat(fh->store_path, &st) || st.st_dev != fh->store_dev || st.st_ino != fh->store_ino) {
+        goto out;
+    }
+    // Files are only shared once they have been added, and their chunks
+    // must not be shared before that either.
+    if (!fh->scratch
+            && vcfs_git(s, (const char *[]){ "ls-files", "--error-unmatch", "--", fh->store_path, NULL })) {
+        goto out;
+    }
 
-static void vcfs_destroy(void* private_data)
-{
-    close(*(int *)private_data);
-    free(private_data);
+    res = vcfs_store_chunks(s, fh->fd, fh->store_path);
+    if (res == 0) {
+        fh->modified = false;
+        // The manifest replaced the file.
+        if (lstat(fh->store_path, &st) == 0) {
+            fh->store_dev = st.st_dev;
+            fh->store_ino = st.st_ino;
+        }
+    }
+out:
+    pthread_mutex_unlock(&s->git_lock);
+    return res;
 }
 
 static int vcfs_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
 {
     (void)path;
 
-    pull_if_needed();
-
     vcfs_file_handle *fh = (vcfs_file_handle *)fi->fh;
-    return fstat(fh->fd, stbuf);
+
+    pthread_mutex_lock(&fh->lock);
+    // Buffered writes may extend the file.
+    vcfs_flush_locked(fh);
+    int res = fstat(fh->fd, stbuf);
+    if (res == -1)
+        res = -errno;
+    else if (fh->chunks)
+        stbuf->st_size = fh->chunks->manifest.size;
+    pthread_mutex_unlock(&fh->lock);
+
+    return res;
 }
 
 static int vcfs_getattr(const char *path, struct stat *stbuf)
 {
-    pull_if_needed();
+    int scope = vcfs_check_scope(path, -ENOENT);
+    if (scope) {
+        return scope;
+    }
+
+    uint64_t start = vcfs_trace_start(TRACE_DEBUG);
+
+    vcfs_state *s = vcfs_get_state();
 
     int res = 0;
 
     char *rpath = vcfs_repo_path(path);
 
+    // Buffered writes may extend the file.
+    vcfs_flush_path(s, path);
     res = lstat(rpath, stbuf);
     if (res == -1) {
         res = -errno;
+    } else if (S_ISREG(stbuf->st_mode) && atomic_load(&s->chunked)) {
+        // Only open the file to look for a manifest if it has changed since
+        // we last did.
+        bool manifest = false;
+        uint64_t size = 0;
+        if (!vcfs_meta_lookup(&s->meta, path, stbuf, &manifest, &size)) {
+            int fd = open(rpath, O_RDONLY | O_CLOEXEC);
+            // Stat what is probed, so a change in between is never cached.
+            if (fd >= 0 && fstat(fd, stbuf) == 0 && S_ISREG(stbuf->st_mode)) {
+                manifest = vcfs_manifest_probe(fd, &size);
+                vcfs_meta_store(&s->meta, path, stbuf, manifest, size);
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        if (manifest) {
+            stbuf->st_size = size;
+            stbuf->st_blocks = (size + 511) / 512;
+        }
     }
 
     free(rpath);
 
+    TRACE_SPAN(TRACE_DEBUG, TRACE_OP_GETATTR, start, res, path);
     return res;
 }
 
 static int vcfs_access(const char *path, int mask)
 {
-    pull_if_needed();
+    int scope = vcfs_check_scope(path, -ENOENT);
+    if (scope) {
+        return scope;
+    }
 
     int res = 0;
 
@@ -238,7 +1523,10 @@ static int vcfs_access(const char *path, int mask)
 
 static int vcfs_readlink(const char *path, char *buf, size_t size)
 {
-    pull_if_needed();
+    int scope = vcfs_check_scope(path, -ENOENT);
+    if (scope) {
+        return scope;
+    }
 
     int res = 0;
 
@@ -260,19 +1548,37 @@ static int vcfs_readlink(const char *path, char *buf, size_t size)
 static int vcfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                         off_t offset, struct fuse_file_info *fi)
 {
-    pull_if_needed();
-
-    DIR *dp;
     struct dirent *de;
 
     (void) offset;
-    (void) path;
 
-    dp = fdopendir(((vcfs_file_handle *)fi->fh)->fd);
-    if (dp == NULL)
-        return -errno;
+    uint64_t start = vcfs_trace_start(TRACE_DEBUG);
+
+    // The stream belongs to the handle; closing it here would close the
+    // descriptor out from under fgetattr and releasedir.
+    DIR *dp = ((vcfs_file_handle *)fi->fh)->dir;
+    rewinddir(dp);
+
+    vcfs_state *s = vcfs_get_state();
+    size_t path_len = strlen(path);
 
     while ((de = readdir(dp)) != NULL) {
+        if (path_len == 1 && strcmp(de->d_name, ".vcfs") == 0) {
+            continue;
+        }
+        if (s->sparse.n_include || s->sparse.n_exclude) {
+            // Hide anything left on disk outside a sparse mount, eg untracked
+            // files from before the sparse patterns changed.
+            char child[PATH_MAX];
+            if (path_len + 1 + strlen(de->d_name) < sizeof(child)) {
+                snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+                if (strcmp(de->d_name, ".") && strcmp(de->d_name, "..")
+                        && !vcfs_sparse_contains(&s->sparse, child)) {
+                    continue;
+                }
+            }
+        }
+
         struct stat st;
         memset(&st, 0, sizeof(st));
         st.st_ino = de->d_ino;
@@ -281,13 +1587,16 @@ static int vcfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
             break;
     }
 
-    closedir(dp);
+    TRACE_SPAN(TRACE_DEBUG, TRACE_OP_READDIR, start, 0, path);
     return 0;
 }
 
 static int vcfs_mknod(const char *path, mode_t mode, dev_t rdev)
 {
-    pull_if_needed();
+    int scope = vcfs_check_scope(path, -EACCES);
+    if (scope) {
+        return scope;
+    }
 
     int res;
     int ret = 0;
@@ -306,6 +1615,8 @@ static int vcfs_mknod(const char *path, mode_t mode, dev_t rdev)
         res = mknod(rpath, mode, rdev);
     if (res == -1)
         ret = -errno;
+    else
+        vcfs_meta_mark_dirty(&vcfs_get_state()->meta, path);
 
     free(rpath);
     return ret;
@@ -313,7 +1624,10 @@ static int vcfs_mknod(const char *path, mode_t mode, dev_t rdev)
 
 static int vcfs_mkdir(const char *path, mode_t mode)
 {
-    pull_if_needed();
+    int scope = vcfs_check_scope(path, -EACCES);
+    if (scope) {
+        return scope;
+    }
 
     int res = 0;
 
@@ -329,7 +1643,10 @@ static int vcfs_mkdir(const char *path, mode_t mode)
 
 static int vcfs_unlink(const char *path)
 {
-    pull_if_needed();
+    int scope = vcfs_check_scope(path, -ENOENT);
+    if (scope) {
+        return scope;
+    }
 
     int res = 0;
 
@@ -338,6 +1655,8 @@ static int vcfs_unlink(const char *path)
     res = unlink(rpath);
     if (res == -1)
         res =  -errno;
+    else
+        vcfs_meta_mark_dirty(&vcfs_get_state()->meta, path);
 
     free(rpath);
     return res;
@@ -345,7 +1664,10 @@ static int vcfs_unlink(const char *path)
 
 static int vcfs_rmdir(const char *path)
 {
-    pull_if_needed();
+    int scope = vcfs_check_scope(path, -ENOENT);
+    if (scope) {
+        return scope;
+    }
 
     int res = 0;
 
@@ -361,7 +1683,10 @@ static int vcfs_rmdir(const char *path)
 
 static int vcfs_symlink(const char *to, const char *from)
 {
-    pull_if_needed();
+    int scope = vcfs_check_scope(from, -EACCES);
+    if (scope) {
+        return scope;
+    }
 
     int res = 0;
 
@@ -370,6 +1695,8 @@ static int vcfs_symlink(const char *to, const char *from)
     res = symlink(to, rfrom);
     if (res == -1)
         res = -errno;
+    else
+        vcfs_meta_mark_dirty(&vcfs_get_state()->meta, from);
 
     free(rfrom);
     return res;
@@ -377,28 +1704,48 @@ static int vcfs_symlink(const char *to, const char *from)
 
 static int vcfs_rename(const char *from, const char *to)
 {
-    pull_if_needed();
+    int scope = vcfs_check_scope(from, -ENOENT);
+    if (scope == 0) {
+        scope = vcfs_check_scope(to, -EACCES);
+    }
+    if (scope) {
+        return scope;
+    }
 
     int res = 0;
 
+    vcfs_state *s = vcfs_get_state();
+
     char * rfrom = vcfs_repo_path(from);
     char * rto = vcfs_repo_path(to);
 
-    char * buf = malloc(30 + strlen(rfrom) + strlen(rto));
+    vcfs_flush_path(s, from);
+    vcfs_flush_path(s, to);
 
-    sprintf(buf, "git ls-files --error-unmatch %s", rfrom);
-    if (system(buf)) {
+    // git mv updates the index, so it must not race with the commit worker,
+    // and handles being stored must not see the old path after it has gone.
+    pthread_mutex_lock(&s->handles_lock);
+    pthread_mutex_lock(&s->git_lock);
+    if (vcfs_git(s, (const char *[]){ "ls-files", "--error-unmatch", "--", rfrom, NULL })) {
         // file untracked
         res = rename(rfrom, rto);
         if (res == -1)
             res = -errno;
     } else {
-        sprintf(buf, "git mv %s %s", rfrom, rto);
-        printf("going to git mv: %s \n", buf);
-        if (system(buf)) {
-            res = -1;
+        if (vcfs_git(s, (const char *[]){ "mv", "--", rfrom, rto, NULL })) {
+            res = -EIO;
         }
     }
+    if (res == 0) {
+        vcfs_rename_handles(s, from, to);
+    }
+    pthread_mutex_unlock(&s->git_lock);
+    pthread_mutex_unlock(&s->handles_lock);
+
+    if (res == 0) {
+        vcfs_meta_mark_dirty(&s->meta, from);
+        vcfs_meta_mark_dirty(&s->meta, to);
+    }
 
     free(rfrom);
     free(rto);
@@ -407,7 +1754,13 @@ static int vcfs_rename(const char *from, const char *to)
 
 static int vcfs_link(const char *from, const char *to)
 {
-    pull_if_needed();
+    int scope = vcfs_check_scope(from, -ENOENT);
+    if (scope == 0) {
+        scope = vcfs_check_scope(to, -EACCES);
+    }
+    if (scope) {
+        return scope;
+    }
 
     char * rfrom = vcfs_repo_path(from);
     char * rto = vcfs_repo_path(to);
@@ -415,6 +1768,8 @@ static int vcfs_link(const char *from, const char *to)
     int res = link(rfrom, rto);
     if (res == -1)
         res = -errno;
+    else
+        vcfs_meta_mark_dirty(&vcfs_get_state()->meta, to);
 
     free(rto);
     free(rfrom);
@@ -424,13 +1779,18 @@ static int vcfs_link(const char *from, const char *to)
 
 static int vcfs_chmod(const char *path, mode_t mode)
 {
-    pull_if_needed();
+    int scope = vcfs_check_scope(path, -ENOENT);
+    if (scope) {
+        return scope;
+    }
 
     char * rpath = vcfs_repo_path(path);
 
     int res = chmod(rpath, mode);
     if (res == -1)
         res =  -errno;
+    else
+        vcfs_meta_mark_dirty(&vcfs_get_state()->meta, path);
 
     free(rpath);
 
@@ -439,7 +1799,10 @@ static int vcfs_chmod(const char *path, mode_t mode)
 
 static int vcfs_chown(const char *path, uid_t uid, gid_t gid)
 {
-    pull_if_needed();
+    int scope = vcfs_check_scope(path, -ENOENT);
+    if (scope) {
+        return scope;
+    }
 
     char * rpath = vcfs_repo_path(path);
 
@@ -454,25 +1817,84 @@ static int vcfs_chown(const char *path, uid_t uid, gid_t gid)
 
 static int vcfs_truncate(const char *path, off_t size)
 {
-    pull_if_needed();
+    int scope = vcfs_check_scope(path, -ENOENT);
+    if (scope) {
+        return scope;
+    }
 
+    vcfs_state *s = vcfs_get_state();
     char * rpath = vcfs_repo_path(path);
 
-    int res = truncate(rpath, size);
-    if (res == -1)
+    // Otherwise they would be written back after the truncation.
+    vcfs_flush_path(s, path);
+
+    int res = 0;
+    uint64_t old_size;
+    int fd = atomic_load(&s->chunked) ? open(rpath, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd >= 0 && vcfs_manifest_probe(fd, &old_size)) {
+        // Rewrite a chunked file from a truncated copy of its contents.
+        int scratch = vcfs_chunk_open_scratch(s->repo_root);
+        if (scratch < 0) {
+            res = scratch;
+        } else {
+            if (size > 0) {
+                res = vcfs_chunk_materialize(s->repo_root, fd, scratch);
+            }
+            if (res == 0 && ftruncate(scratch, size) == -1) {
+                res = -errno;
+            }
+            if (res == 0) {
+                pthread_mutex_lock(&s->git_lock);
+                res = vcfs_store_chunks(s, scratch, rpath);
+                pthread_mutex_unlock(&s->git_lock);
+            }
+            close(scratch);
+        }
+    } else if (truncate(rpath, size) == -1) {
         res = -errno;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (res == 0) {
+        vcfs_meta_mark_dirty(&s->meta, path);
+    }
 
     free(rpath);
 
     return res;
 }
 
+static int vcfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    (void)path;
+
+    vcfs_file_handle *fh = (vcfs_file_handle *)fi->fh;
+
+    pthread_mutex_lock(&fh->lock);
+    vcfs_flush_locked(fh);
+    int res = fh->chunks ? -EBADF : ftruncate(fh->fd, size);
+    if (res == -1)
+        res = -errno;
+    else if (res == 0)
+        fh->modified = true;
+    pthread_mutex_unlock(&fh->lock);
+
+    return res;
+}
+
 static int vcfs_utimens(const char *path, const struct timespec ts[2])
 {
-    pull_if_needed();
+    int scope = vcfs_check_scope(path, -ENOENT);
+    if (scope) {
+        return scope;
+    }
 
     char * rpath = vcfs_repo_path(path);
 
+    // A later write back would bump the mtime again.
+    vcfs_flush_path(vcfs_get_state(), path);
+
     struct timeval tv[2];
 
     tv[0].tv_sec = ts[0].tv_sec;
@@ -489,13 +1911,57 @@ static int vcfs_utimens(const char *path, const struct timespec ts[2])
     return res;
 }
 
+/**
+ * Set up a handle on a chunked file, whose manifest is open on `fh->fd`.
+ * Read-only handles read straight from the chunks. Anything else works on a
+ * private copy of the contents, which is chunked again once it is modified.
+ *
+ * Returns 0 on success or a negative errno value.
+ */
+static int vcfs_open_chunked(vcfs_state *s, vcfs_file_handle *fh, int flags)
+{
+    if ((flags & O_ACCMODE) == O_RDONLY) {
+        fh->chunks = (vcfs_chunk_reader *)malloc(sizeof(vcfs_chunk_reader));
+        if (fh->chunks == NULL) {
+            return -ENOMEM;
+        }
+        int res = vcfs_chunk_reader_open(fh->chunks, s->repo_root, fh->fd);
+        if (res) {
+            free(fh->chunks);
+            fh->chunks = NULL;
+        }
+        return res;
+    }
+
+    int scratch = vcfs_chunk_open_scratch(s->repo_root);
+    if (scratch < 0) {
+        return scratch;
+    }
+    if (!(flags & O_TRUNC)) {
+        int res = vcfs_chunk_materialize(s->repo_root, fh->fd, scratch);
+        if (res) {
+            close(scratch);
+            return res;
+        }
+    }
+
+    close(fh->fd);
+    fh->fd = scratch;
+    fh->scratch = true;
+    fh->modified = flags & O_TRUNC;
+    return 0;
+}
+
 static int vcfs_open(const char *path, struct fuse_file_info *fi)
 {
-    pull_if_needed();
+    uint64_t start = vcfs_trace_start(TRACE_DEBUG);
 
-    int res = 0;
+    int res = vcfs_check_scope(path, (fi->flags & O_CREAT) ? -EACCES : -ENOENT);
+    if (res) {
+        goto err_alloc_fh;
+    }
 
-    vcfs_file_handle *fh = (vcfs_file_handle *)malloc(sizeof(vcfs_file_handle));
+    vcfs_file_handle *fh = (vcfs_file_handle *)calloc(1, sizeof(vcfs_file_handle));
     if (fh == NULL) {
         res = -errno;
         goto err_alloc_fh;
@@ -507,25 +1973,121 @@ static int vcfs_open(const char *path, struct fuse_file_info *fi)
         goto err_rpath;
     }
 
-    fh->fd = open(rpath, fi->flags);
+    vcfs_state *s = vcfs_get_state();
+
+    int flags = fi->flags;
+    if (flags & O_TRUNC) {
+        // Otherwise they would be written back after the truncation.
+        vcfs_flush_path(s, path);
+    }
+
+    // A manifest can only be recognised through a readable descriptor, and
+    // truncating one would lose the chunk list, so leave that to
+    // vcfs_open_chunked.
+    bool chunked = atomic_load(&s->chunked);
+    int open_flags = flags;
+    if (chunked) {
+        open_flags &= ~O_TRUNC;
+        if ((open_flags & O_ACCMODE) == O_WRONLY) {
+            open_flags = (open_flags & ~O_ACCMODE) | O_RDWR;
+        }
+    }
+    fh->fd = open(rpath, open_flags);
+    if (fh->fd == -1 && chunked && errno == EACCES) {
+        fh->fd = open(rpath, flags & ~O_TRUNC);
+    }
     if (fh->fd == -1) {
         res = -errno;
         goto err_open;
     }
+    struct stat st;
+    if (fstat(fh->fd, &st) == 0) {
+        fh->store_dev = st.st_dev;
+        fh->store_ino = st.st_ino;
+    }
+
+    uint64_t size;
+    if (chunked && vcfs_manifest_probe(fh->fd, &size)) {
+        res = vcfs_open_chunked(s, fh, flags);
+    } else if (chunked && (flags & O_TRUNC) && ftruncate(fh->fd, 0) == -1) {
+        res = -errno;
+    }
+    if (res) {
+        close(fh->fd);
+        goto err_open;
+    }
+
+    if ((flags & O_ACCMODE) != O_RDONLY && (fh->scratch || s->chunk_threshold)) {
+        fh->store_path = rpath;
+        rpath = NULL;
+    }
+
+    if ((flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC)) {
+        fh->path = strdup(path);
+        if (fh->path == NULL) {
+            res = -ENOMEM;
+            close(fh->fd);
+            free(fh->store_path);
+            goto err_open;
+        }
+        fh->writable = true;
+        vcfs_meta_mark_dirty(&s->meta, path);
+    }
 
+    pthread_mutex_init(&fh->lock, NULL);
     fi->fh = (intptr_t)fh;
 
+    if (fh->writable) {
+        pthread_mutex_lock(&s->handles_lock);
+        fh->next = s->write_handles;
+        if (fh->next != NULL) {
+            fh->next->prev = fh;
+        }
+        s->write_handles = fh;
+        pthread_mutex_unlock(&s->handles_lock);
+    }
+
+    if (s->prefetch_budget) {
+        vcfs_profile_record(&s->profile, path);
+    }
+
 err_open:
     free(rpath);
 err_rpath:
     if (res) free(fh);
 err_alloc_fh:
+    TRACE_SPAN(TRACE_DEBUG, TRACE_OP_OPEN, start, res, path);
     return res;
 }
 
 static int vcfs_opendir(const char *path, struct fuse_file_info *fi)
 {
-    return vcfs_open(path, fi);
+    int scope = vcfs_check_scope(path, -ENOENT);
+    if (scope) {
+        return scope;
+    }
+
+    int res = 0;
+
+    vcfs_file_handle *fh = (vcfs_file_handle *)calloc(1, sizeof(vcfs_file_handle));
+    if (fh == NULL) {
+        return -errno;
+    }
+
+    char *rpath = vcfs_repo_path(path);
+
+    fh->dir = opendir(rpath);
+    if (fh->dir == NULL) {
+        res = -errno;
+        free(fh);
+    } else {
+        fh->fd = dirfd(fh->dir);
+        pthread_mutex_init(&fh->lock, NULL);
+        fi->fh = (intptr_t)fh;
+    }
+
+    free(rpath);
+    return res;
 }
 
 static int vcfs_read(const char *path, char *buf, size_t size, off_t offset,
@@ -533,14 +2095,30 @@ static int vcfs_read(const char *path, char *buf, size_t size, off_t offset,
 {
     (void)path;
 
-    pull_if_needed();
+    uint64_t start = vcfs_trace_start(TRACE_DEBUG);
 
     vcfs_file_handle *fh = (vcfs_file_handle *)fi->fh;
 
-    int res = pread(fh->fd, buf, size, offset);
+    int res;
+    pthread_mutex_lock(&fh->lock);
+    if (fh->chunks) {
+        res = vcfs_chunk_reader_read(fh->chunks, buf, size, offset);
+        pthread_mutex_unlock(&fh->lock);
+        goto out;
+    }
+    if (fh->wbuf_len > 0 && offset < fh->wbuf_off + (off_t)fh->wbuf_len
+            && fh->wbuf_off < offset + (off_t)size) {
+        // Make sure we read back what was written through this handle.
+        vcfs_flush_locked(fh);
+    }
+    pthread_mutex_unlock(&fh->lock);
+
+    res = pread(fh->fd, buf, size, offset);
     if (res == -1)
         res = -errno;
 
+out:
+    TRACE_SPAN(TRACE_DEBUG, TRACE_OP_READ, start, res, NULL);
     return res;
 }
 
@@ -549,21 +2127,51 @@ static int vcfs_write(const char *path, const char *buf, size_t size,
 {
     (void)path;
 
-    pull_if_needed();
+    uint64_t start = vcfs_trace_start(TRACE_DEBUG);
 
     vcfs_file_handle *fh = (vcfs_file_handle *)fi->fh;
+    int res = size;
 
-    int res = pwrite(fh->fd, buf, size, offset);
-    if (res == -1)
-        res = -errno;
+    pthread_mutex_lock(&fh->lock);
+
+    fh->modified = true;
+
+    if (fh->wbuf_len > 0 && (offset != fh->wbuf_off + (off_t)fh->wbuf_len
+                || fh->wbuf_len + size > VCFS_WRITE_BUFFER_SIZE)) {
+        // Not contiguous with what we have, or it would not fit.
+        int err = vcfs_flush_locked(fh);
+        if (err) {
+            fh->wbuf_err = 0;
+            pthread_mutex_unlock(&fh->lock);
+            return err;
+        }
+    }
+
+    if (fh->wbuf == NULL && size < VCFS_WRITE_BUFFER_SIZE) {
+        fh->wbuf = (char *)malloc(VCFS_WRITE_BUFFER_SIZE);
+    }
+
+    if (size >= VCFS_WRITE_BUFFER_SIZE || fh->wbuf == NULL) {
+        // Large writes gain nothing from the buffer.
+        res = pwrite(fh->fd, buf, size, offset);
+        if (res == -1)
+            res = -errno;
+    } else {
+        if (fh->wbuf_len == 0) {
+            fh->wbuf_off = offset;
+        }
+        memcpy(fh->wbuf + fh->wbuf_len, buf, size);
+        fh->wbuf_len += size;
+    }
 
+    pthread_mutex_unlock(&fh->lock);
+
+    TRACE_SPAN(TRACE_DEBUG, TRACE_OP_WRITE, start, res, NULL);
     return res;
 }
 
 static int vcfs_statfs(const char *path, struct statvfs *stbuf)
 {
-    pull_if_needed();
-
     char *rpath = vcfs_repo_path(path);
 
     int res = statvfs(rpath, stbuf);
@@ -576,52 +2184,109 @@ static int vcfs_statfs(const char *path, struct statvfs *stbuf)
     return res;
 }
 
+static int vcfs_flush(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t start = vcfs_trace_start(TRACE_DEBUG);
+
+    int res = vcfs_flush_handle((vcfs_file_handle *)fi->fh);
+
+    TRACE_SPAN(TRACE_DEBUG, TRACE_OP_FLUSH, start, res, path);
+    return res;
+}
+
 static int vcfs_fsync(const char *path, int isdatasync,
              struct fuse_file_info *fi)
 {
-    (void)path;
     (void)isdatasync;
-    (void)fi;
-
-    if (system("git diff-index --quiet HEAD --") == 0) {
-        // No changes
-        pull_if_needed();
-        return 0;
-    }
 
-    if (system("git commit -am \"automated commit\"")) {
-        return -1;
-    }
+    uint64_t start = vcfs_trace_start(TRACE_DEBUG);
 
-    pull_if_needed();
+    vcfs_state *s = vcfs_get_state();
+    vcfs_file_handle *fh = (vcfs_file_handle *)fi->fh;
 
-    if (system("git push")) {
-        return -1;
+    int res = vcfs_flush_handle(fh);
+    if (res == 0) {
+        pthread_mutex_lock(&fh->lock);
+        res = vcfs_store_handle(s, fh);
+        pthread_mutex_unlock(&fh->lock);
+    }
+    if (res == 0) {
+        // A commit since the handle was opened may have taken its path
+        // out of the dirty set before the latest writes.
+        if (fh->writable && path != NULL) {
+            vcfs_meta_mark_dirty(&s->meta, path);
+        }
+        res = vcfs_wait_commit(s, vcfs_request_commit(s));
     }
 
-    return 0;
+    TRACE_SPAN(TRACE_DEBUG, TRACE_OP_FSYNC, start, res, path);
+    return res;
 }
 
 static int vcfs_release(const char *path, struct fuse_file_info *fi)
 {
-    (void)path;
+    uint64_t start = vcfs_trace_start(TRACE_DEBUG);
 
+    vcfs_state *s = vcfs_get_state();
     vcfs_file_handle *fh = (vcfs_file_handle *)fi->fh;
 
+    vcfs_flush_handle(fh);
+    // Nobody is told if this fails, but the failure is traced.
+    pthread_mutex_lock(&fh->lock);
+    vcfs_store_handle(s, fh);
+    pthread_mutex_unlock(&fh->lock);
+    if (fh->writable && path != NULL) {
+        vcfs_meta_mark_dirty(&s->meta, path);
+    }
+
+    // Only once stored, so renames until then are followed.
+    if (fh->writable) {
+        pthread_mutex_lock(&s->handles_lock);
+        if (fh->prev != NULL) {
+            fh->prev->next = fh->next;
+        } else {
+            s->write_handles = fh->next;
+        }
+        if (fh->next != NULL) {
+            fh->next->prev = fh->prev;
+        }
+        pthread_mutex_unlock(&s->handles_lock);
+    }
     close(fh->fd);
+    if (fh->chunks) {
+        vcfs_chunk_reader_close(fh->chunks);
+        free(fh->chunks);
+    }
+    pthread_mutex_destroy(&fh->lock);
+    free(fh->path);
+    free(fh->store_path);
+    free(fh->wbuf);
     free(fh);
 
-    return vcfs_fsync(path, 0, fi);
+    // The kernel ignores our return value here, so there is no point making
+    // the caller wait for the push.
+    vcfs_request_commit(s);
+
+    TRACE_SPAN(TRACE_DEBUG, TRACE_OP_RELEASE, start, 0, path);
+    return 0;
 }
 
 static int vcfs_releasedir(const char *path, struct fuse_file_info *fi)
 {
-    return vcfs_release(path, fi);
+    (void)path;
+
+    vcfs_file_handle *fh = (vcfs_file_handle *)fi->fh;
+
+    closedir(fh->dir);
+    pthread_mutex_destroy(&fh->lock);
+    free(fh);
+
+    return 0;
 }
 
 static struct fuse_operations vcfs_oper = {
     .init       = vcfs_init,
-    .destroy    =vcfs_destroy,
+    .destroy    = vcfs_destroy,
     .getattr    = vcfs_getattr,
     .fgetattr   = vcfs_fgetattr,
     .access     = vcfs_access,
@@ -637,12 +2302,14 @@ static struct fuse_operations vcfs_oper = {
     .chmod      = vcfs_chmod,
     .chown      = vcfs_chown,
     .truncate   = vcfs_truncate,
+    .ftruncate  = vcfs_ftruncate,
     .utimens    = vcfs_utimens,
     .open       = vcfs_open,
     .opendir    = vcfs_opendir,
     .read       = vcfs_read,
     .write      = vcfs_write,
     .statfs     = vcfs_statfs,
+    .flush      = vcfs_flush,
     .release    = vcfs_release,
     .releasedir = vcfs_releasedir,
     .fsync      = vcfs_fsync
@@ -654,17 +2321,126 @@ int main(int argc, char *argv[])
         fprintf(stderr, "Usage: %s <mnt> <ip> <port>\n", argv[0]);
         return 1;
     }
-    mount_point = argv[argc-3];
+    const char *mount_point = argv[argc-3];
     const char *ip_str = argv[argc-2];
-    port = atoi(argv[argc-1]);
+
+    static vcfs_state state;
+    state.port = atoi(argv[argc-1]);
+    state.sockfd = -1;
 
     int ip_bytes[4];
     if (sscanf(ip_str, "%d.%d.%d.%d", ip_bytes, ip_bytes + 1, ip_bytes + 2, ip_bytes + 3) != 4) {
         fprintf(stderr, "Invalid ip address %s\n", ip_str);
         return 1;
     }
-    ip = ip_bytes[3] + ip_bytes[2]*256 + ip_bytes[1]*256*256 + ip_bytes[0]*256*256*256;
+    state.ip = ip_bytes[3] + ip_bytes[2]*256 + ip_bytes[1]*256*256 + ip_bytes[0]*256*256*256;
+
+    // Resolve the backing repository once, before any FUSE threads exist.
+    const char *prefix = getenv("VCFS_PREFIX");
+    if (prefix == NULL) {
+        prefix = "/vcfs";
+    }
+    size_t prefix_len = strlen(prefix);
+    size_t mount_point_len = strlen(mount_point);
+    state.repo_root = (char *)malloc(prefix_len + mount_point_len + 1);
+    if (state.repo_root == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    memcpy(state.repo_root, prefix, prefix_len);
+    memcpy(state.repo_root + prefix_len, mount_point, mount_point_len + 1);
+    state.repo_root_len = prefix_len + mount_point_len;
+
+    // A sparse mount (see vcfs-mount) only serves what its patterns cover.
+    char sparse[16];
+    if (vcfs_git_output(&state, (const char *[]){ "config", "--bool", "core.sparseCheckout", NULL },
+                        sparse, sizeof(sparse)) == 0 && strcmp(sparse, "true") == 0) {
+        char sparse_file[PATH_MAX];
+        char git_path[PATH_MAX];
+        if (vcfs_git_output(&state, (const char *[]){ "rev-parse", "--git-path", "info/sparse-checkout", NULL },
+                            git_path, sizeof(git_path))) {
+            fprintf(stderr, "Could not find sparse-checkout file\n");
+            return 1;
+        }
+        int len = git_path[0] == '/'
+            ? snprintf(sparse_file, sizeof(sparse_file), "%s", git_path)
+            : snprintf(sparse_file, sizeof(sparse_file), "%s/%s", state.repo_root, git_path);
+        if (len >= (int)sizeof(sparse_file)) {
+            fprintf(stderr, "Repository path too long\n");
+            return 1;
+        }
+        if (vcfs_sparse_load(&state.sparse, sparse_file)) {
+            perror(sparse_file);
+            return 1;
+        }
+        state.sparse_file = strdup(sparse_file);
+        if (state.sparse_file == NULL) {
+            perror("strdup");
+            return 1;
+        }
+    }
+
+    // Large file mode: tracked files of this many MiB or more are stored as
+    // chunks (see chunk.h). Files which are already chunked are read and
+    // written transparently either way.
+    const char *threshold = getenv("VCFS_CHUNK_THRESHOLD_MB");
+    if (threshold != NULL) {
+        state.chunk_threshold = strtoull(threshold, NULL, 10) * 1024 * 1024;
+    }
+    atomic_init(&state.chunked, false);
+    // vcfs-mount only checks out the files themselves.
+    vcfs_sparse_refresh(&state);
+    vcfs_check_chunked(&state);
+
+    // Prefetch budget in MiB; the profile it is spent by is kept per mount.
+    const char *prefetch = getenv("VCFS_PREFETCH_MB");
+    state.prefetch_budget = (prefetch ? strtoull(prefetch, NULL, 10) : 64) * 1024 * 1024;
+    if (state.prefetch_budget) {
+        char git_path[PATH_MAX];
+        if (vcfs_git_output(&state, (const char *[]){ "rev-parse", "--git-path", "vcfs/profile", NULL },
+                            git_path, sizeof(git_path))) {
+            fprintf(stderr, "Could not find git directory\n");
+            return 1;
+        }
+        if (git_path[0] == '/') {
+            state.profile_file = strdup(git_path);
+        } else if (asprintf(&state.profile_file, "%s/%s", state.repo_root, git_path) < 0) {
+            state.profile_file = NULL;
+        }
+        if (state.profile_file == NULL || vcfs_profile_load(&state.profile, state.profile_file)) {
+            perror("profile");
+            return 1;
+        }
+    }
+
+    // What the last mount knew, if it was unmounted cleanly.
+    char git_path[PATH_MAX];
+    if (vcfs_git_output(&state, (const char *[]){ "rev-parse", "--git-path", "vcfs/meta", NULL },
+                        git_path, sizeof(git_path))) {
+        fprintf(stderr, "Could not find git directory\n");
+        return 1;
+    }
+    if (git_path[0] == '/') {
+        state.meta_file = strdup(git_path);
+    } else if (asprintf(&state.meta_file, "%s/%s", state.repo_root, git_path) < 0) {
+        state.meta_file = NULL;
+    }
+    if (state.meta_file == NULL || vcfs_meta_load(&state.meta, state.meta_file)) {
+        perror("metadata cache");
+        return 1;
+    }
+    vcfs_reconcile_meta(&state);
 
+    vcfs_trace_resolve_path();
     umask(0);
-    return fuse_main(argc-2, argv, &vcfs_oper, NULL);
+    int res = fuse_main(argc-2, argv, &vcfs_oper, &state);
+    vcfs_meta_free(&state.meta);
+    free(state.meta_file);
+    vcfs_profile_free(&state.profile);
+    free(state.profile_file);
+    vcfs_free_chunk_paths(state.sparse_chunks, state.n_sparse_chunks);
+    free(state.sparse_file);
+    vcfs_sparse_free(&state.sparse);
+    free(state.repo_root);
+    return res;
 }
@@ -0,0 +1,536 @@
+#define _GNU_SOURCE
+
+#include "metacache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define META_MAGIC "VCFSMET1"
+
+// Must be a power of two.
+#define META_BUCKETS 4096
+
+// Beyond this many entries learned in one mount, new ones aren't kept.
+#define META_MAX_ATTRS 65536
+
+#define META_ATTR_MANIFEST  1
+
+// The snapshot doesn't know which paths are dirty.
+#define META_DIRTY_UNKNOWN  1
+
+/*
+ * Snapshot layout: the header, the attribute records sorted by path, the
+ * dirty paths, then the path strings they point into. Native byte order:
+ * the file never leaves this machine.
+ */
+typedef struct meta_header
+{
+    char        magic[8];
+    uint32_t    flags;
+    uint32_t    n_attrs;
+    uint32_t    n_dirty;
+    uint32_t    strings_len;
+    char        head[VCFS_META_HEAD_SIZE];
+} meta_header;
+
+typedef struct meta_file_attr
+{
+    uint32_t        path_off;
+    uint32_t        path_len;
+    vcfs_meta_attr  attr;
+} meta_file_attr;
+
+typedef struct meta_file_path
+{
+    uint32_t    path_off;
+    uint32_t    path_len;
+} meta_file_path;
+
+struct vcfs_meta_node
+{
+    vcfs_meta_node *next;
+    bool            forgotten;
+    vcfs_meta_attr  attr;
+    char            path[];
+};
+
+static uint32_t hash_path(const char *path)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (; *path; ++path) {
+        h = (h ^ (uint8_t)*path) * 16777619u;
+    }
+    return h;
+}
+
+static vcfs_meta_node **find(vcfs_meta_node **table, const char *path)
+{
+    vcfs_meta_node **n = &table[hash_path(path) & (META_BUCKETS - 1)];
+    while (*n != NULL && strcmp((*n)->path, path) != 0) {
+        n = &(*n)->next;
+    }
+    return n;
+}
+
+/**
+ * Returns the node for `path`, adding it if it isn't there.
+ */
+static vcfs_meta_node *add(vcfs_meta_node **table, size_t *count, const char *path)
+{
+    vcfs_meta_node **n = find(table, path);
+    if (*n != NULL) {
+        return *n;
+    }
+
+    size_t len = strlen(path);
+    vcfs_meta_node *node = (vcfs_meta_node *)calloc(1, sizeof(vcfs_meta_node) + len + 1);
+    if (node == NULL) {
+        return NULL;
+    }
+    memcpy(node->path, path, len + 1);
+    *n = node;
+    ++*count;
+    return node;
+}
+
+static void clear(vcfs_meta_node **table, size_t *count)
+{
+    for (size_t i = 0; i < META_BUCKETS; ++i) {
+        while (table[i] != NULL) {
+            vcfs_meta_node *next = table[i]->next;
+            free(table[i]);
+            table[i] = next;
+        }
+    }
+    *count = 0;
+}
+
+static const meta_header *map_header(const vcfs_metacache *m)
+{
+    return (const meta_header *)m->map;
+}
+
+static const meta_file_attr *map_attrs(const vcfs_metacache *m)
+{
+    return (const meta_file_attr *)(m->map + sizeof(meta_header));
+}
+
+static const meta_file_path *map_dirty(const vcfs_metacache *m)
+{
+    return (const meta_file_path *)(map_attrs(m) + map_header(m)->n_attrs);
+}
+
+static const char *map_strings(const vcfs_metacache *m)
+{
+    return (const char *)(map_dirty(m) + map_header(m)->n_dirty);
+}
+
+static int compare_path(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+    int res = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (res == 0 && a_len != b_len) {
+        res = a_len < b_len ? -1 : 1;
+    }
+    return res;
+}
+
+/**
+ * Binary search the snapshot for `path`.
+ */
+static const vcfs_meta_attr *map_find(const vcfs_metacache *m, const char *path)
+{
+    if (m->map == NULL) {
+        return NULL;
+    }
+
+    const meta_file_attr *attrs = map_attrs(m);
+    const char *strings = map_strings(m);
+    size_t path_len = strlen(path);
+    size_t lo = 0, hi = map_header(m)->n_attrs;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int res = compare_path(strings + attrs[mid].path_off, attrs[mid].path_len, path, path_len);
+        if (res == 0) {
+            return &attrs[mid].attr;
+        }
+        if (res < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Check that the mapped snapshot is consistent before trusting any of it.
+ */
+static bool map_valid(const vcfs_metacache *m)
+{
+    if (m->map_len < sizeof(meta_header)) {
+        return false;
+    }
+    const meta_header *h = map_header(m);
+    if (memcmp(h->magic, META_MAGIC, sizeof(h->magic)) != 0
+            || h->head[VCFS_META_HEAD_SIZE - 1] != '\0'
+            || h->n_attrs > m->map_len / sizeof(meta_file_attr)
+            || h->n_dirty > m->map_len / sizeof(meta_file_path)
+            || sizeof(meta_header) + h->n_attrs * sizeof(meta_file_attr)
+                + h->n_dirty * sizeof(meta_file_path) + (size_t)h->strings_len != m->map_len) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < h->n_attrs; ++i) {
+        const meta_file_attr *a = &map_attrs(m)[i];
+        if ((uint64_t)a->path_off + a->path_len > h->strings_len) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < h->n_dirty; ++i) {
+        const meta_file_path *d = &map_dirty(m)[i];
+        if ((uint64_t)d->path_off + d->path_len > h->strings_len) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int vcfs_meta_load(vcfs_metacache *m, const char *file)
+{
+    memset(m, 0, sizeof(*m));
+    m->attrs = (vcfs_meta_node **)calloc(META_BUCKETS, sizeof(vcfs_meta_node *));
+    m->dirty = (vcfs_meta_node **)calloc(META_BUCKETS, sizeof(vcfs_meta_node *));
+    if (m->attrs == NULL || m->dirty == NULL) {
+        free(m->attrs);
+        free(m->dirty);
+        errno = ENOMEM;
+        return -1;
+    }
+    pthread_mutex_init(&m->lock, NULL);
+
+    // Until we know better.
+    m->dirty_unknown = true;
+
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    // Consume the snapshot: if we crash, the next mount must not trust the
+    // dirty set in it. The mapping outlives the file.
+    unlink(file);
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            m->map = (const char *)map;
+            m->map_len = st.st_size;
+        }
+    }
+    close(fd);
+
+    if (m->map == NULL) {
+        return 0;
+    }
+    if (!map_valid(m)) {
+        munmap((void *)m->map, m->map_len);
+        m->map = NULL;
+        m->map_len = 0;
+        return 0;
+    }
+
+    const meta_header *h = map_header(m);
+    memcpy(m->head, h->head, sizeof(m->head));
+    if (!(h->flags & META_DIRTY_UNKNOWN)) {
+        m->dirty_unknown = false;
+        for (uint32_t i = 0; i < h->n_dirty; ++i) {
+            const meta_file_path *d = &map_dirty(m)[i];
+            char *path = strndup(map_strings(m) + d->path_off, d->path_len);
+            if (path == NULL || add(m->dirty, &m->n_dirty, path) == NULL) {
+                m->dirty_unknown = true;
+            }
+            free(path);
+        }
+    }
+    return 0;
+}
+
+typedef struct save_attr
+{
+    const char             *path;
+    size_t                  path_len;
+    const vcfs_meta_attr   *attr;
+} save_attr;
+
+static int compare_save_attr(const void *a, const void *b)
+{
+    const save_attr *sa = (const save_attr *)a;
+    const save_attr *sb = (const save_attr *)b;
+    return compare_path(sa->path, sa->path_len, sb->path, sb->path_len);
+}
+
+int vcfs_meta_save(vcfs_metacache *m, const char *file, const char *head)
+{
+    pthread_mutex_lock(&m->lock);
+
+    int res = -1;
+    save_attr *attrs = NULL;
+    const vcfs_meta_node **dirty = NULL;
+    FILE *f = NULL;
+
+    // Everything learned this mount, plus whatever of the snapshot wasn't
+    // superseded or forgotten.
+    size_t n_map = m->map ? map_header(m)->n_attrs : 0;
+    attrs = (save_attr *)malloc((m->n_attrs + n_map + 1) * sizeof(save_attr));
+    dirty = (const vcfs_meta_node **)malloc((m->n_dirty + 1) * sizeof(vcfs_meta_node *));
+    if (attrs == NULL || dirty == NULL) {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    size_t n_attrs = 0, n_dirty = 0, strings_len = 0;
+    for (size_t i = 0; i < META_BUCKETS; ++i) {
+        for (const vcfs_meta_node *n = m->attrs[i]; n != NULL; n = n->next) {
+            if (!n->forgotten) {
+                attrs[n_attrs].path = n->path;
+                attrs[n_attrs].path_len = strlen(n->path);
+                attrs[n_attrs].attr = &n->attr;
+                strings_len += attrs[n_attrs++].path_len;
+            }
+        }
+        for (const vcfs_meta_node *n = m->dirty[i]; n != NULL; n = n->next) {
+            dirty[n_dirty++] = n;
+            strings_len += strlen(n->path);
+        }
+    }
+    for (size_t i = 0; i < n_map; ++i) {
+        const meta_file_attr *a = &map_attrs(m)[i];
+        char *path = strndup(map_strings(m) + a->path_off, a->path_len);
+        bool superseded = path == NULL || *find(m->attrs, path) != NULL;
+        free(path);
+        if (!superseded) {
+            attrs[n_attrs].path = map_strings(m) + a->path_off;
+            attrs[n_attrs].path_len = a->path_len;
+            attrs[n_attrs].attr = &a->attr;
+            strings_len += attrs[n_attrs++].path_len;
+        }
+    }
+    if (strings_len > UINT32_MAX) {
+        errno = EFBIG;
+        goto out;
+    }
+
+    qsort(attrs, n_attrs, sizeof(save_attr), compare_save_attr);
+
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", file) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        goto out;
+    }
+    char *slash = strrchr(tmp, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+        mkdir(tmp, 0755);
+        *slash = '/';
+    }
+
+    // The mount runs with a zero umask.
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    f = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (f == NULL) {
+        if (fd >= 0) close(fd);
+        goto out;
+    }
+
+    meta_header h = {0};
+    memcpy(h.magic, META_MAGIC, sizeof(h.magic));
+    h.flags = m->dirty_unknown ? META_DIRTY_UNKNOWN : 0;
+    h.n_attrs = n_attrs;
+    h.n_dirty = n_dirty;
+    h.strings_len = strings_len;
+    snprintf(h.head, sizeof(h.head), "%s", head);
+    fwrite(&h, sizeof(h), 1, f);
+
+    uint32_t off = 0;
+    for (size_t i = 0; i < n_attrs; ++i) {
+        meta_file_attr a = { off, attrs[i].path_len, *attrs[i].attr };
+        fwrite(&a, sizeof(a), 1, f);
+        off += a.path_len;
+    }
+    for (size_t i = 0; i < n_dirty; ++i) {
+        meta_file_path d = { off, strlen(dirty[i]->path) };
+        fwrite(&d, sizeof(d), 1, f);
+        off += d.path_len;
+    }
+    for (size_t i = 0; i < n_attrs; ++i) {
+        fwrite(attrs[i].path, 1, attrs[i].path_len, f);
+    }
+    for (size_t i = 0; i < n_dirty; ++i) {
+        fputs(dirty[i]->path, f);
+    }
+
+    int err = ferror(f);
+    if (fclose(f) == 0 && !err && rename(tmp, file) == 0) {
+        res = 0;
+    } else {
+        unlink(tmp);
+    }
+
+out:
+    free(attrs);
+    free(dirty);
+    pthread_mutex_unlock(&m->lock);
+    return res;
+}
+
+void vcfs_meta_free(vcfs_metacache *m)
+{
+    if (m->attrs == NULL) {
+        return;
+    }
+    clear(m->attrs, &m->n_attrs);
+    clear(m->dirty, &m->n_dirty);
+    free(m->attrs);
+    free(m->dirty);
+    if (m->map != NULL) {
+        munmap((void *)m->map, m->map_len);
+    }
+    pthread_mutex_destroy(&m->lock);
+    memset(m, 0, sizeof(*m));
+}
+
+bool vcfs_meta_lookup(vcfs_metacache *m, const char *path, const struct stat *st,
+                      bool *manifest, uint64_t *logical_size)
+{
+    if (m->attrs == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&m->lock);
+
+    const vcfs_meta_attr *a = NULL;
+    vcfs_meta_node *n = *find(m->attrs, path);
+    if (n != NULL) {
+        a = n->forgotten ? NULL : &n->attr;
+    } else {
+        a = map_find(m, path);
+    }
+
+    bool found = a != NULL && a->ino == (uint64_t)st->st_ino && a->size == (uint64_t)st->st_size
+        && a->mtime_ns == (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    if (found) {
+        *manifest = a->flags & META_ATTR_MANIFEST;
+        *logical_size = a->logical_size;
+    }
+
+    pthread_mutex_unlock(&m->lock);
+    return found;
+}
+
+void vcfs_meta_store(vcfs_metacache *m, const char *path, const struct stat *st,
+                     bool manifest, uint64_t logical_size)
+{
+    if (m->attrs == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&m->lock);
+    vcfs_meta_node *n = *find(m->attrs, path);
+    if (n == NULL && m->n_attrs < META_MAX_ATTRS) {
+        n = add(m->attrs, &m->n_attrs, path);
+    }
+    if (n != NULL) {
+        n->forgotten = false;
+        n->attr.ino = st->st_ino;
+        n->attr.mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+        n->attr.size = st->st_size;
+        n->attr.logical_size = logical_size;
+        n->attr.flags = manifest ? META_ATTR_MANIFEST : 0;
+    }
+    pthread_mutex_unlock(&m->lock);
+}
+
+void vcfs_meta_forget(vcfs_metacache *m, const char *path)
+{
+    if (m->attrs == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&m->lock);
+    vcfs_meta_node *n = *find(m->attrs, path);
+    if (n == NULL && map_find(m, path) != NULL) {
+        // Hide the snapshot's entry.
+        n = add(m->attrs, &m->n_attrs, path);
+    }
+    if (n != NULL) {
+        n->forgotten = true;
+    }
+    pthread_mutex_unlock(&m->lock);
+}
+
+void vcfs_meta_mark_dirty(vcfs_metacache *m, const char *path)
+{
+    if (m->dirty == NULL) {
+        return;
+    }
+
+    while (*path == '/') {
+        ++path;
+    }
+
+    pthread_mutex_lock(&m->lock);
+    if (!m->dirty_unknown && add(m->dirty, &m->n_dirty, path) == NULL) {
+        m->dirty_unknown = true;
+    }
+    pthread_mutex_unlock(&m->lock);
+}
+
+ssize_t vcfs_meta_take_dirty(vcfs_metacache *m, size_t max, char ***paths)
+{
+    pthread_mutex_lock(&m->lock);
+
+    ssize_t n = -1;
+    *paths = NULL;
+    if (!m->dirty_unknown && m->n_dirty <= max) {
+        *paths = (char **)malloc((m->n_dirty + 1) * sizeof(char *));
+    }
+    if (!m->dirty_unknown && m->n_dirty <= max && *paths != NULL) {
+        n = 0;
+        for (size_t i = 0; i < META_BUCKETS; ++i) {
+            for (vcfs_meta_node *node = m->dirty[i]; node != NULL; node = node->next) {
+                (*paths)[n] = strdup(node->path);
+                if ((*paths)[n] == NULL) {
+                    // Give up on the list and check everything.
+                    while (n > 0) {
+                        free((*paths)[--n]);
+                    }
+                    free(*paths);
+                    *paths = NULL;
+                    n = -1;
+                    goto out;
+                }
+                ++n;
+            }
+        }
+    }
+
+out:
+    clear(m->dirty, &m->n_dirty);
+    m->dirty_unknown = false;
+    pthread_mutex_unlock(&m->lock);
+    return n;
+}
+
+void vcfs_meta_dirty_unknown(vcfs_metacache *m)
+{
+    pthread_mutex_lock(&m->lock);
+    clear(m->dirty, &m->n_dirty);
+    m->dirty_unknown = true;
+    pthread_mutex_unlock(&m->lock);
+}
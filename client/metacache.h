@@ -0,0 +1,125 @@
+#ifndef VCFS_METACACHE_H
+#define VCFS_METACACHE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/**
+ * Metadata which survives remounts.
+ *
+ * This holds two things:
+ *
+ *  - What getattr learned about regular files: whether each one is a chunk
+ *    manifest and, if so, the size of the file it describes. An entry is
+ *    only used while the file's inode, size and mtime still match, so a
+ *    remount doesn't have to open every file again to find out.
+ *  - The dirty set: paths changed through the mount since they were last
+ *    committed. Commits only look at these, rather than making git compare
+ *    the whole tree with HEAD.
+ *
+ * On unmount both are written to a file in the git directory, along with
+ * the HEAD they were taken at. The next mount maps that file and serves
+ * lookups straight from the mapping. If HEAD has moved in between, entries
+ * for the paths which changed are dropped (see vcfs_meta_forget).
+ *
+ * The file is consumed when it is loaded, so after a crash the next mount
+ * starts cold and commits with a scan of the whole tree, as before.
+ */
+
+#define VCFS_META_HEAD_SIZE 48
+
+typedef struct vcfs_meta_attr
+{
+    uint64_t    ino;
+    int64_t     mtime_ns;
+    uint64_t    size;
+    // Size of the file described, if this is a manifest.
+    uint64_t    logical_size;
+    uint32_t    flags;
+    uint32_t    reserved;
+} vcfs_meta_attr;
+
+typedef struct vcfs_meta_node vcfs_meta_node;
+
+typedef struct vcfs_metacache
+{
+    pthread_mutex_t     lock;
+
+    // The snapshot loaded at mount, mapped read-only.
+    const char         *map;
+    size_t              map_len;
+    char                head[VCFS_META_HEAD_SIZE];
+
+    // Attributes learned (or forgotten) since, which take precedence over
+    // the snapshot.
+    vcfs_meta_node    **attrs;
+    size_t              n_attrs;
+
+    // Paths changed since they were last committed.
+    vcfs_meta_node    **dirty;
+    size_t              n_dirty;
+    // Set when the dirty set can't be trusted, eg after a crash: the next
+    // commit must scan the whole tree.
+    bool                dirty_unknown;
+} vcfs_metacache;
+
+/**
+ * Load (and consume) the snapshot saved in `file`, if there is one. After
+ * this `m->head` is the HEAD the snapshot was taken at, or empty.
+ *
+ * Returns 0 on success or -1 with errno set.
+ */
+int vcfs_meta_load(vcfs_metacache *m, const char *file);
+
+/**
+ * Save a snapshot taken at `head` to `file`.
+ *
+ * Returns 0 on success or -1 with errno set.
+ */
+int vcfs_meta_save(vcfs_metacache *m, const char *file, const char *head);
+
+void vcfs_meta_free(vcfs_metacache *m);
+
+/**
+ * Look up what is known about `path` (relative to the mount, with a leading
+ * slash), which `st` was just read from.
+ *
+ * Returns whether there is an entry matching `st`, storing whether the file
+ * is a manifest in `manifest` and if so its logical size in `logical_size`.
+ */
+bool vcfs_meta_lookup(vcfs_metacache *m, const char *path, const struct stat *st,
+                      bool *manifest, uint64_t *logical_size);
+
+void vcfs_meta_store(vcfs_metacache *m, const char *path, const struct stat *st,
+                     bool manifest, uint64_t logical_size);
+
+/**
+ * Drop anything known about `path`.
+ */
+void vcfs_meta_forget(vcfs_metacache *m, const char *path);
+
+/**
+ * Add `path` to the dirty set.
+ */
+void vcfs_meta_mark_dirty(vcfs_metacache *m, const char *path);
+
+/**
+ * Empty the dirty set into `paths` (without leading slashes), which the
+ * caller must free along with the strings, and return how many there are.
+ * Returns -1 if the dirty set is unknown or has grown past `max`, in which
+ * case it is cleared and the caller should check the whole tree.
+ *
+ * If committing the paths fails, they must be marked dirty again.
+ */
+ssize_t vcfs_meta_take_dirty(vcfs_metacache *m, size_t max, char ***paths);
+
+/**
+ * Mark the dirty set unknown, so the next commit checks the whole tree.
+ */
+void vcfs_meta_dirty_unknown(vcfs_metacache *m);
+
+#endif
@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+
+#include "profile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROFILE_MAGIC "VCFSPRF1"
+
+// Must be a power of two, comfortably bigger than VCFS_PROFILE_MAX_PATHS.
+#define PROFILE_TABLE_SIZE (2 * VCFS_PROFILE_MAX_PATHS)
+
+// Opens this close together count as one following the other.
+#define PROFILE_SUCC_WINDOW_MS 2000
+
+// Counts are halved once one reaches this, so old habits fade.
+#define PROFILE_AGE_LIMIT (1 << 20)
+
+#define PROFILE_NONE UINT32_MAX
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t hash_path(const char *path)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (; *path; ++path) {
+        h = (h ^ (uint8_t)*path) * 16777619u;
+    }
+    return h;
+}
+
+static uint32_t find(const vcfs_profile *p, const char *path)
+{
+    for (uint32_t i = hash_path(path); ; ++i) {
+        uint32_t slot = p->table[i & (PROFILE_TABLE_SIZE - 1)];
+        if (slot == 0) {
+            return PROFILE_NONE;
+        }
+        if (strcmp(p->entries[slot - 1].path, path) == 0) {
+            return slot - 1;
+        }
+    }
+}
+
+static void insert_slot(vcfs_profile *p, uint32_t idx)
+{
+    uint32_t i = hash_path(p->entries[idx].path);
+    while (p->table[i & (PROFILE_TABLE_SIZE - 1)] != 0) {
+        ++i;
+    }
+    p->table[i & (PROFILE_TABLE_SIZE - 1)] = idx + 1;
+}
+
+/**
+ * Halve every count and forget paths and successors whose count drops to
+ * zero, renumbering what is left.
+ */
+static void age(vcfs_profile *p)
+{
+    uint32_t *remap = (uint32_t *)malloc(p->n_entries * sizeof(uint32_t));
+    if (remap == NULL) {
+        return;
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < p->n_entries; ++i) {
+        vcfs_profile_entry *e = &p->entries[i];
+        e->count /= 2;
+        if (e->count == 0) {
+            free(e->path);
+            remap[i] = PROFILE_NONE;
+            continue;
+        }
+        remap[i] = kept;
+        p->entries[kept++] = *e;
+    }
+    p->n_entries = kept;
+
+    memset(p->table, 0, PROFILE_TABLE_SIZE * sizeof(uint32_t));
+    for (size_t i = 0; i < p->n_entries; ++i) {
+        vcfs_profile_entry *e = &p->entries[i];
+        for (int j = 0; j < VCFS_PROFILE_MAX_SUCC; ++j) {
+            vcfs_profile_succ *succ = &e->succ[j];
+            succ->count /= 2;
+            if (succ->count == 0 || remap[succ->idx] == PROFILE_NONE) {
+                succ->count = 0;
+                succ->idx = 0;
+            } else {
+                succ->idx = remap[succ->idx];
+            }
+        }
+        insert_slot(p, i);
+    }
+
+    if (p->last != PROFILE_NONE) {
+        p->last = remap[p->last];
+    }
+    free(remap);
+}
+
+static void bump_succ(vcfs_profile_entry *e, uint32_t idx)
+{
+    vcfs_profile_succ *least = &e->succ[0];
+    for (int i = 0; i < VCFS_PROFILE_MAX_SUCC; ++i) {
+        vcfs_profile_succ *succ = &e->succ[i];
+        if (succ->count > 0 && succ->idx == idx) {
+            ++succ->count;
+            return;
+        }
+        if (succ->count < least->count) {
+            least = succ;
+        }
+    }
+
+    // Evict the weakest successor; a new one has to earn its place.
+    least->idx = idx;
+    least->count = 1;
+}
+
+static int init(vcfs_profile *p)
+{
+    memset(p, 0, sizeof(*p));
+    p->last = PROFILE_NONE;
+    p->entries = (vcfs_profile_entry *)calloc(VCFS_PROFILE_MAX_PATHS, sizeof(vcfs_profile_entry));
+    p->table = (uint32_t *)calloc(PROFILE_TABLE_SIZE, sizeof(uint32_t));
+    if (p->entries == NULL || p->table == NULL) {
+        free(p->entries);
+        free(p->table);
+        errno = ENOMEM;
+        return -1;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    return 0;
+}
+
+int vcfs_profile_load(vcfs_profile *p, const char *file)
+{
+    if (init(p)) {
+        return -1;
+    }
+
+    FILE *f = fopen(file, "r");
+    if (f == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    char magic[sizeof(PROFILE_MAGIC) - 1];
+    uint32_t n;
+    if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, PROFILE_MAGIC, sizeof(magic)) != 0
+            || fread(&n, sizeof(n), 1, f) != 1 || n > VCFS_PROFILE_MAX_PATHS) {
+        // Not worth failing the mount over; start again.
+        fclose(f);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < n; ++i) {
+        vcfs_profile_entry e;
+        uint16_t len;
+        if (fread(&e.count, sizeof(e.count), 1, f) != 1 || fread(&len, sizeof(len), 1, f) != 1) {
+            break;
+        }
+        e.path = (char *)malloc(len + 1);
+        if (e.path == NULL || fread(e.path, 1, len, f) != len
+                || fread(e.succ, sizeof(e.succ), 1, f) != 1) {
+            free(e.path);
+            break;
+        }
+        e.path[len] = '\0';
+        p->entries[p->n_entries] = e;
+        insert_slot(p, p->n_entries++);
+    }
+    fclose(f);
+
+    // Drop successors lost to a truncated file.
+    for (size_t i = 0; i < p->n_entries; ++i) {
+        for (int j = 0; j < VCFS_PROFILE_MAX_SUCC; ++j) {
+            if (p->entries[i].succ[j].idx >= p->n_entries) {
+                p->entries[i].succ[j].idx = 0;
+                p->entries[i].succ[j].count = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+int vcfs_profile_save(vcfs_profile *p, const char *file)
+{
+    pthread_mutex_lock(&p->lock);
+    if (!p->dirty) {
+        pthread_mutex_unlock(&p->lock);
+        return 0;
+    }
+
+    char tmp[4096];
+    int res = -1;
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", file) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        goto out;
+    }
+
+    // The profile lives in its own directory in the git directory.
+    char *slash = strrchr(tmp, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+        mkdir(tmp, 0755);
+        *slash = '/';
+    }
+
+    // The mount runs with a zero umask.
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    FILE *f = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (f == NULL) {
+        if (fd >= 0) close(fd);
+        goto out;
+    }
+
+    // Native byte order: the profile never leaves this machine.
+    uint32_t n = p->n_entries;
+    fwrite(PROFILE_MAGIC, sizeof(PROFILE_MAGIC) - 1, 1, f);
+    fwrite(&n, sizeof(n), 1, f);
+    for (size_t i = 0; i < p->n_entries; ++i) {
+        const vcfs_profile_entry *e = &p->entries[i];
+        uint16_t len = strlen(e->path);
+        fwrite(&e->count, sizeof(e->count), 1, f);
+        fwrite(&len, sizeof(len), 1, f);
+        fwrite(e->path, 1, len, f);
+        fwrite(e->succ, sizeof(e->succ), 1, f);
+    }
+
+    if (fclose(f) == 0 && rename(tmp, file) == 0) {
+        p->dirty = false;
+        res = 0;
+    } else {
+        unlink(tmp);
+    }
+
+out:
+    pthread_mutex_unlock(&p->lock);
+    return res;
+}
+
+void vcfs_profile_free(vcfs_profile *p)
+{
+    if (p->entries == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < p->n_entries; ++i) {
+        free(p->entries[i].path);
+    }
+    free(p->entries);
+    free(p->table);
+    pthread_mutex_destroy(&p->lock);
+    memset(p, 0, sizeof(*p));
+}
+
+void vcfs_profile_record(vcfs_profile *p, const char *path)
+{
+    if (p->entries == NULL || strlen(path) > UINT16_MAX) {
+        return;
+    }
+
+    uint64_t now = now_ms();
+
+    pthread_mutex_lock(&p->lock);
+
+    uint32_t idx = find(p, path);
+    if (idx == PROFILE_NONE) {
+        if (p->n_entries == VCFS_PROFILE_MAX_PATHS) {
+            // Make room by forgetting what has been opened least.
+            while (p->n_entries > VCFS_PROFILE_MAX_PATHS * 3 / 4) {
+                age(p);
+            }
+        }
+        char *copy = strdup(path);
+        if (copy == NULL) {
+            pthread_mutex_unlock(&p->lock);
+            return;
+        }
+        idx = p->n_entries++;
+        memset(&p->entries[idx], 0, sizeof(vcfs_profile_entry));
+        p->entries[idx].path = copy;
+        insert_slot(p, idx);
+    }
+
+    if (++p->entries[idx].count >= PROFILE_AGE_LIMIT) {
+        age(p);
+        idx = find(p, path);
+    }
+
+    if (p->last != PROFILE_NONE && p->last != idx && now - p->last_ms <= PROFILE_SUCC_WINDOW_MS) {
+        bump_succ(&p->entries[p->last], idx);
+    }
+    p->last = idx;
+    p->last_ms = now;
+    p->dirty = true;
+
+    pthread_mutex_unlock(&p->lock);
+}
+
+typedef struct scored
+{
+    uint64_t    score;
+    uint32_t    idx;
+} scored;
+
+static int compare_scored(const void *a, const void *b)
+{
+    const scored *sa = (const scored *)a;
+    const scored *sb = (const scored *)b;
+    return sa->score < sb->score ? 1 : sa->score > sb->score ? -1 : 0;
+}
+
+size_t vcfs_profile_predict(vcfs_profile *p, const char *const *changed, size_t n_changed,
+                            char **out, size_t max)
+{
+    if (p->entries == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&p->lock);
+
+    scored *scores = (scored *)calloc(p->n_entries + 1, sizeof(scored));
+    if (scores == NULL) {
+        pthread_mutex_unlock(&p->lock);
+        return 0;
+    }
+    for (size_t i = 0; i < p->n_entries; ++i) {
+        scores[i].idx = i;
+        if (n_changed == 0) {
+            scores[i].score = p->entries[i].count;
+        }
+    }
+
+    for (size_t i = 0; i < n_changed; ++i) {
+        uint32_t idx = find(p, changed[i]);
+        if (idx == PROFILE_NONE) {
+            // Nobody has read it here; leave it cold.
+            continue;
+        }
+        const vcfs_profile_entry *e = &p->entries[idx];
+        // A changed file which is read at all is read first, so rank it
+        // ahead of anything which merely follows it.
+        scores[idx].score += (uint64_t)e->count * PROFILE_AGE_LIMIT;
+        for (int j = 0; j < VCFS_PROFILE_MAX_SUCC; ++j) {
+            scores[e->succ[j].idx].score += e->succ[j].count;
+        }
+    }
+
+    qsort(scores, p->n_entries, sizeof(scored), compare_scored);
+
+    size_t n = 0;
+    for (size_t i = 0; i < p->n_entries && n < max && scores[i].score > 0; ++i) {
+        out[n] = strdup(p->entries[scores[i].idx].path);
+        if (out[n] != NULL) {
+            ++n;
+        }
+    }
+
+    free(scores);
+    pthread_mutex_unlock(&p->lock);
+    return n;
+}
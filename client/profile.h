@@ -0,0 +1,82 @@
+#ifndef VCFS_PROFILE_H
+#define VCFS_PROFILE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Which files a mount reads, and in what order.
+ *
+ * For every path opened through the mount the profile keeps how often it
+ * was opened and the few paths most often opened right after it. This is
+ * used to warm the files most likely to be read next after a pull brings in
+ * changes, and at mount time. The profile is bounded and saved to a small
+ * binary file in the repository's git directory, so it survives remounts.
+ */
+
+// Paths remembered, and successors remembered per path.
+#define VCFS_PROFILE_MAX_PATHS  4096
+#define VCFS_PROFILE_MAX_SUCC   4
+
+typedef struct vcfs_profile_succ
+{
+    uint32_t    idx;
+    uint32_t    count;
+} vcfs_profile_succ;
+
+typedef struct vcfs_profile_entry
+{
+    char               *path;
+    uint32_t            count;
+    vcfs_profile_succ   succ[VCFS_PROFILE_MAX_SUCC];
+} vcfs_profile_entry;
+
+typedef struct vcfs_profile
+{
+    pthread_mutex_t     lock;
+    vcfs_profile_entry *entries;
+    size_t              n_entries;
+    // Open addressing table of entry indices + 1, 0 for empty slots.
+    uint32_t           *table;
+    // The path opened last and when, in milliseconds.
+    uint32_t            last;
+    uint64_t            last_ms;
+    bool                dirty;
+} vcfs_profile;
+
+/**
+ * Load the profile saved in `file`, or start an empty one if there is none.
+ *
+ * Returns 0 on success or -1 with errno set.
+ */
+int vcfs_profile_load(vcfs_profile *p, const char *file);
+
+/**
+ * Save the profile to `file` if it has changed since it was loaded or last
+ * saved.
+ *
+ * Returns 0 on success or -1 with errno set.
+ */
+int vcfs_profile_save(vcfs_profile *p, const char *file);
+
+void vcfs_profile_free(vcfs_profile *p);
+
+/**
+ * Note that `path` (relative to the mount, with a leading slash) was opened.
+ */
+void vcfs_profile_record(vcfs_profile *p, const char *path);
+
+/**
+ * Store up to `max` paths most likely to be read next in `out`, best first.
+ * If `changed` is not empty, these are the changed paths which have been
+ * read before and the paths usually read after them; otherwise they are the
+ * paths read most often. The caller must free the strings.
+ *
+ * Returns the number of paths stored.
+ */
+size_t vcfs_profile_predict(vcfs_profile *p, const char *const *changed, size_t n_changed,
+                            char **out, size_t max);
+
+#endif
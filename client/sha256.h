@@ -0,0 +1,24 @@
+#ifndef VCFS_SHA256_H
+#define VCFS_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define VCFS_SHA256_SIZE 32
+
+/**
+ * Incremental SHA-256 (FIPS 180-4), used to name chunks by their content.
+ */
+typedef struct vcfs_sha256
+{
+    uint32_t    state[8];
+    uint64_t    length;
+    uint8_t     block[64];
+    size_t      block_len;
+} vcfs_sha256;
+
+void vcfs_sha256_init(vcfs_sha256 *ctx);
+void vcfs_sha256_update(vcfs_sha256 *ctx, const void *data, size_t len);
+void vcfs_sha256_final(vcfs_sha256 *ctx, uint8_t digest[VCFS_SHA256_SIZE]);
+
+#endif
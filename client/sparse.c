@@ -0,0 +1,249 @@
+#define _GNU_SOURCE
+
+#include "sparse.h"
+
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int add_pattern(char ***list, size_t *n, const char *pattern)
+{
+    char **grown = (char **)realloc(*list, (*n + 1) * sizeof(char *));
+    if (grown == NULL) {
+        return -1;
+    }
+    *list = grown;
+
+    grown[*n] = strdup(pattern);
+    if (grown[*n] == NULL) {
+        return -1;
+    }
+    ++*n;
+    return 0;
+}
+
+int vcfs_sparse_load(vcfs_sparse *sp, const char *file)
+{
+    memset(sp, 0, sizeof(*sp));
+
+    FILE *f = fopen(file, "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    FILE *text = open_memstream(&sp->text, &sp->text_len);
+    if (text == NULL) {
+        fclose(f);
+        return -1;
+    }
+
+    int res = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_cap, f)) >= 0) {
+        if (strcmp(line, VCFS_SPARSE_CHUNKS) == 0) {
+            break;
+        }
+        if (fputs(line, text) == EOF) {
+            res = -1;
+            break;
+        }
+
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '/')) {
+            line[--len] = '\0';
+        }
+
+        char *pattern = line;
+        bool negated = false;
+        if (*pattern == '!') {
+            negated = true;
+            ++pattern;
+        }
+        while (*pattern == '/') {
+            ++pattern;
+        }
+        if (*pattern == '\0' || *pattern == '#') {
+            continue;
+        }
+
+        if (negated) {
+            res = add_pattern(&sp->exclude, &sp->n_exclude, pattern);
+        } else {
+            res = add_pattern(&sp->include, &sp->n_include, pattern);
+        }
+        if (res) {
+            break;
+        }
+    }
+
+    free(line);
+    fclose(f);
+    if (fclose(text)) {
+        res = -1;
+    }
+    if (res) {
+        vcfs_sparse_free(sp);
+    }
+    return res;
+}
+
+int vcfs_sparse_save(const vcfs_sparse *sp, const char *file, char *const *chunks, size_t n_chunks)
+{
+    char *tmp;
+    if (asprintf(&tmp, "%s.vcfs-tmp", file) < 0) {
+        return -1;
+    }
+
+    // Write a copy and rename it over the file, so git never sees half of
+    // it.
+    int res = -1;
+    FILE *f = fopen(tmp, "w");
+    if (f != NULL) {
+        fwrite(sp->text, 1, sp->text_len, f);
+        if (sp->text_len > 0 && sp->text[sp->text_len - 1] != '\n') {
+            fputc('\n', f);
+        }
+        if (n_chunks > 0) {
+            fputs(VCFS_SPARSE_CHUNKS, f);
+        }
+        for (size_t i = 0; i < n_chunks; ++i) {
+            fprintf(f, "%s\n", chunks[i]);
+        }
+        bool failed = ferror(f);
+        if (fclose(f) == 0 && !failed && rename(tmp, file) == 0) {
+            res = 0;
+        }
+    }
+    if (res) {
+        int err = errno;
+        unlink(tmp);
+        errno = err;
+    }
+    free(tmp);
+    return res;
+}
+
+void vcfs_sparse_free(vcfs_sparse *sp)
+{
+    for (size_t i = 0; i < sp->n_include; ++i) free(sp->include[i]);
+    for (size_t i = 0; i < sp->n_exclude; ++i) free(sp->exclude[i]);
+    free(sp->include);
+    free(sp->exclude);
+    free(sp->text);
+    memset(sp, 0, sizeof(*sp));
+}
+
+/**
+ * Copy the path component starting at `c` into `buf`.
+ *
+ * Returns a pointer to the start of the next component, or to the
+ * terminating NUL, or NULL if the component does not fit.
+ */
+static const char *component(const char *c, char *buf, size_t size)
+{
+    size_t len = strcspn(c, "/");
+    if (len >= size) {
+        return NULL;
+    }
+    memcpy(buf, c, len);
+    buf[len] = '\0';
+    return c[len] == '/' ? c + len + 1 : c + len;
+}
+
+/**
+ * Match the components of `pattern` against those of `path`, starting at
+ * the beginning of a component of each, the way git matches sparse-checkout
+ * patterns: `*`, `?` and brackets do not match `/`, and a `**` component
+ * matches any number of components, including none.
+ *
+ * A pattern which runs out first matches, since everything below a matched
+ * directory is matched too. A path which runs out first matches only if
+ * `leading` is set, ie if we are asking whether the path is a directory on
+ * the way to something the pattern could match.
+ */
+static bool match_components(const char *pattern, const char *path, bool leading)
+{
+    if (*pattern == '\0') {
+        return true;
+    }
+
+    char pc[256];
+    const char *next_pattern = component(pattern, pc, sizeof(pc));
+    if (next_pattern == NULL) {
+        return false;
+    }
+
+    if (strcmp(pc, "**") == 0) {
+        // Try swallowing none of the remaining components, then one, ...
+        for (const char *c = path; ; ) {
+            if (match_components(next_pattern, c, leading)) {
+                return true;
+            }
+            if (*c == '\0') {
+                return false;
+            }
+            c += strcspn(c, "/");
+            if (*c == '/') {
+                ++c;
+            }
+        }
+    }
+
+    if (*path == '\0') {
+        return leading;
+    }
+
+    char sc[256];
+    const char *next_path = component(path, sc, sizeof(sc));
+    if (next_path == NULL || fnmatch(pc, sc, 0) != 0) {
+        return false;
+    }
+    return match_components(next_pattern, next_path, leading);
+}
+
+/**
+ * Returns whether `pattern` matches `path` or one of its parents.
+ */
+static bool matches(const char *pattern, const char *path)
+{
+    return match_components(pattern, path, false);
+}
+
+/**
+ * Returns whether `path` is a directory leading to something `pattern` could
+ * match, ie whether it matches the first components of `pattern`.
+ */
+static bool leads_to(const char *pattern, const char *path)
+{
+    return match_components(pattern, path, true);
+}
+
+bool vcfs_sparse_contains(const vcfs_sparse *sp, const char *path)
+{
+    while (*path == '/') {
+        ++path;
+    }
+    if (*path == '\0') {
+        return true;
+    }
+
+    for (size_t i = 0; i < sp->n_exclude; ++i) {
+        if (matches(sp->exclude[i], path)) {
+            return false;
+        }
+    }
+
+    if (sp->n_include == 0) {
+        return true;
+    }
+    for (size_t i = 0; i < sp->n_include; ++i) {
+        if (matches(sp->include[i], path) || leads_to(sp->include[i], path)) {
+            return true;
+        }
+    }
+    return false;
+}
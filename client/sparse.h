@@ -0,0 +1,58 @@
+#ifndef VCFS_SPARSE_H
+#define VCFS_SPARSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * The set of paths a sparse mount materializes.
+ *
+ * This is read from the non-cone sparse-checkout file that vcfs-mount writes,
+ * so the view served through FUSE agrees with what git checks out. Each line
+ * is a pattern anchored at the repository root matching a path and everything
+ * below it; lines starting with `!` exclude instead. Exclusions win over
+ * inclusions. Wildcards work as in git, including `**` for any number of
+ * directories.
+ *
+ * The client appends the chunks of the chunked files in the mount to the
+ * file, after VCFS_SPARSE_CHUNKS, so git checks those out too. They are not
+ * patterns of the mount.
+ */
+typedef struct vcfs_sparse
+{
+    char  **include;
+    size_t  n_include;
+    char  **exclude;
+    size_t  n_exclude;
+    // The file as vcfs-mount wrote it, up to any chunks.
+    char   *text;
+    size_t  text_len;
+} vcfs_sparse;
+
+#define VCFS_SPARSE_CHUNKS "# Chunks of the chunked files above, kept by vcfs-client\n"
+
+/**
+ * Load patterns from a sparse-checkout file.
+ *
+ * Returns 0 on success or -1 with errno set.
+ */
+int vcfs_sparse_load(vcfs_sparse *sp, const char *file);
+
+void vcfs_sparse_free(vcfs_sparse *sp);
+
+/**
+ * Rewrite the sparse-checkout file with the patterns it was loaded with,
+ * followed by `chunks`, the paths of the chunks to check out.
+ *
+ * Returns 0 on success or -1 with errno set.
+ */
+int vcfs_sparse_save(const vcfs_sparse *sp, const char *file, char *const *chunks, size_t n_chunks);
+
+/**
+ * Returns whether `path` (relative to the mount, with or without a leading
+ * slash) is part of the mount. Directories leading to included paths are
+ * part of the mount, so they can be traversed.
+ */
+bool vcfs_sparse_contains(const vcfs_sparse *sp, const char *path);
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef VCFS_PROTOCOL_H
+#define VCFS_PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+
+/**
+ * Wire format between the server and clients.
+ *
+ * Every message is a frame: a 32-bit big-endian length of everything after
+ * it, a one byte type, then a type-specific body. Integers are big-endian.
+ *
+ * A client opens with HELLO, naming the server epoch and the last sequence
+ * number it has seen (0 and 0 for a new client). The server answers with
+ * WELCOME and then either replays the notifications the client missed, or,
+ * if those have fallen out of its replay log or the server restarted since,
+ * sends RESET to tell the client to fetch everything. After that the server
+ * sends NOTIFY for every push and a HEARTBEAT whenever it has been idle for
+ * the heartbeat interval, so clients can spot dead connections.
+ *
+ * A server in relay mode subscribes to another server like a client, but
+ * opens with RELAY_HELLO instead, naming itself. It is then sent RELAY
+ * instead of NOTIFY and RESET, which also lists the servers the message has
+ * passed through (starting with the one it came from), so relays can drop
+ * anything which has come round a cycle.
+ */
+
+typedef enum vcfs_msg_type
+{
+    // client -> server: u64 epoch, u64 last seen sequence number
+    VCFS_MSG_HELLO = 1,
+    // server -> client: u64 epoch, u64 current sequence number,
+    // u32 heartbeat interval in seconds
+    VCFS_MSG_WELCOME,
+    // server -> client: u64 sequence number, branch name, optionally followed
+    // by a space and the SHA the branch now points to
+    VCFS_MSG_NOTIFY,
+    // server -> client: u64 current sequence number
+    VCFS_MSG_HEARTBEAT,
+    // server -> client: u64 current sequence number
+    VCFS_MSG_RESET,
+    // relay -> server: u64 epoch, u64 last seen sequence number, u64 node id
+    VCFS_MSG_RELAY_HELLO,
+    // server -> relay: u64 sequence number, u8 type of the message relayed
+    // (NOTIFY or RESET), u8 number of hops, that many u64 node ids, then the
+    // body of the message after its sequence number
+    VCFS_MSG_RELAY,
+} vcfs_msg_type;
+
+// Frame header: length and type.
+#define VCFS_FRAME_HEADER_SIZE (sizeof(uint32_t) + 1)
+
+// Largest frame either side will accept.
+#define VCFS_MAX_FRAME_SIZE 4096
+
+// Longest chain of servers a message may pass through.
+#define VCFS_MAX_HOPS 16
+
+// Most a RELAY frame adds to the body of the message it carries.
+#define VCFS_RELAY_OVERHEAD (2 + VCFS_MAX_HOPS * sizeof(uint64_t))
+
+static inline void vcfs_put_u32(char *buf, uint32_t v)
+{
+    v = htonl(v);
+    memcpy(buf, &v, sizeof(v));
+}
+
+static inline uint32_t vcfs_get_u32(const char *buf)
+{
+    uint32_t v;
+    memcpy(&v, buf, sizeof(v));
+    return ntohl(v);
+}
+
+static inline void vcfs_put_u64(char *buf, uint64_t v)
+{
+    vcfs_put_u32(buf, (uint32_t)(v >> 32));
+    vcfs_put_u32(buf + 4, (uint32_t)v);
+}
+
+static inline uint64_t vcfs_get_u64(const char *buf)
+{
+    return ((uint64_t)vcfs_get_u32(buf) << 32) | vcfs_get_u32(buf + 4);
+}
+
+/**
+ * Write a frame header for a body of `body_len` bytes into `buf`.
+ *
+ * Returns the size of the header.
+ */
+static inline size_t vcfs_put_frame_header(char *buf, vcfs_msg_type type, size_t body_len)
+{
+    vcfs_put_u32(buf, (uint32_t)(1 + body_len));
+    buf[sizeof(uint32_t)] = (char)type;
+    return VCFS_FRAME_HEADER_SIZE;
+}
+
+#endif
@@ -0,0 +1,155 @@
+#include "trace.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static int compare_records(const void *a, const void *b)
+{
+    const vcfs_trace_record *ra = (const vcfs_trace_record *)a;
+    const vcfs_trace_record *rb = (const vcfs_trace_record *)b;
+    if (ra->timestamp_ns != rb->timestamp_ns) {
+        return ra->timestamp_ns < rb->timestamp_ns ? -1 : 1;
+    }
+    return 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t ua = *(const uint64_t *)a;
+    uint64_t ub = *(const uint64_t *)b;
+    return ua < ub ? -1 : ua > ub;
+}
+
+static void print_record(const vcfs_trace_header *header, const vcfs_trace_record *rec)
+{
+    uint64_t wall_ns = header->realtime_ns + (rec->timestamp_ns - header->monotonic_ns);
+    time_t secs = wall_ns / 1000000000;
+    struct tm tm;
+    localtime_r(&secs, &tm);
+    char when[32];
+    strftime(when, sizeof(when), "%H:%M:%S", &tm);
+
+    printf("%s.%06" PRIu64 " %6" PRIu32 " %-5s %-14s %10.3fms %8" PRId64 " %.*s\n",
+           when, (wall_ns % 1000000000) / 1000, rec->tid,
+           vcfs_trace_level_name(rec->level), vcfs_trace_op_name(rec->op),
+           rec->duration_ns / 1e6, rec->arg, rec->str_len, rec->str);
+}
+
+/**
+ * Print count and latency percentiles for every op with timed records.
+ */
+static void print_summary(const vcfs_trace_record *recs, size_t count)
+{
+    printf("%-14s %8s %10s %10s %10s %10s\n", "op", "count", "p50 ms", "p99 ms", "max ms", "total ms");
+
+    uint64_t *durations = (uint64_t *)malloc(count * sizeof(uint64_t) + 1);
+    if (durations == NULL) {
+        perror("malloc");
+        return;
+    }
+
+    for (int op = 0; op < TRACE_OP_COUNT; ++op) {
+        size_t n = 0;
+        uint64_t total = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (recs[i].op == op && recs[i].duration_ns) {
+                durations[n++] = recs[i].duration_ns;
+                total += recs[i].duration_ns;
+            }
+        }
+        if (n == 0) {
+            continue;
+        }
+
+        qsort(durations, n, sizeof(uint64_t), compare_u64);
+        printf("%-14s %8zu %10.3f %10.3f %10.3f %10.3f\n", vcfs_trace_op_name(op), n,
+               durations[n / 2] / 1e6, durations[(n * 99) / 100] / 1e6,
+               durations[n - 1] / 1e6, total / 1e6);
+    }
+
+    free(durations);
+}
+
+int main(int argc, char **argv)
+{
+    int max_level = TRACE_DEBUG;
+    double min_ms = 0;
+    bool summary = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "l:m:s")) != -1) {
+        switch (opt) {
+        case 'l':
+            max_level = vcfs_trace_parse_level(optarg);
+            if (max_level < 0) {
+                goto usage;
+            }
+            break;
+        case 'm':
+            min_ms = atof(optarg);
+            break;
+        case 's':
+            summary = true;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1) {
+        goto usage;
+    }
+
+    FILE *f = fopen(argv[optind], "r");
+    if (f == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    vcfs_trace_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1
+            || memcmp(header.magic, VCFS_TRACE_MAGIC, sizeof(header.magic)) != 0
+            || header.record_size != sizeof(vcfs_trace_record)) {
+        fprintf(stderr, "%s: not a vcfs trace file\n", argv[optind]);
+        return 1;
+    }
+
+    size_t cap = 4096, count = 0;
+    vcfs_trace_record *recs = (vcfs_trace_record *)malloc(cap * sizeof(vcfs_trace_record));
+    while (recs != NULL && fread(&recs[count], sizeof(vcfs_trace_record), 1, f) == 1) {
+        const vcfs_trace_record *rec = &recs[count];
+        if (rec->level > max_level || rec->duration_ns < min_ms * 1e6) {
+            continue;
+        }
+        if (++count == cap) {
+            cap *= 2;
+            recs = (vcfs_trace_record *)realloc(recs, cap * sizeof(vcfs_trace_record));
+        }
+    }
+    fclose(f);
+    if (recs == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    // Each thread's records are drained in batches, so restore global order.
+    qsort(recs, count, sizeof(vcfs_trace_record), compare_records);
+
+    if (summary) {
+        printf("%.*s: %zu records\n", (int)sizeof(header.component), header.component, count);
+        print_summary(recs, count);
+    } else {
+        for (size_t i = 0; i < count; ++i) {
+            print_record(&header, &recs[i]);
+        }
+    }
+
+    free(recs);
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: %s [-l <max level>] [-m <min ms>] [-s] <trace file>\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,340 @@
+#define _GNU_SOURCE
+
+#include "trace.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Records per thread. Must be a power of two.
+#define TRACE_RING_SIZE 4096
+
+// How often the drain thread wakes up, in milliseconds.
+#define TRACE_DRAIN_INTERVAL_MS 100
+
+/**
+ * A single-producer, single-consumer ring. The owning thread is the only one
+ * which advances `head` and the drain thread is the only one which advances
+ * `tail`, so neither side needs a lock.
+ */
+typedef struct trace_ring
+{
+    _Atomic uint64_t            head;
+    _Atomic uint64_t            tail;
+    _Atomic uint64_t            dropped;
+    // Set while a live thread is producing into this ring.
+    atomic_bool                 in_use;
+    uint32_t                    tid;
+    struct trace_ring          *next;
+    vcfs_trace_record           records[TRACE_RING_SIZE];
+} trace_ring;
+
+atomic_int vcfs_trace_level_enabled = TRACE_OFF;
+
+// Rings are never freed: when a thread exits its ring is handed to the next
+// new thread, so the list only grows to the peak number of threads.
+static _Atomic(trace_ring *) rings = NULL;
+static __thread trace_ring *my_ring = NULL;
+static pthread_key_t ring_key;
+
+static FILE *trace_file = NULL;
+static pthread_t drain_thread;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;
+static bool drain_stopping = false;
+
+static const char *op_names[TRACE_OP_COUNT] = {
+    [TRACE_OP_NONE]             = "none",
+    [TRACE_OP_GETATTR]          = "getattr",
+    [TRACE_OP_OPEN]             = "open",
+    [TRACE_OP_READ]             = "read",
+    [TRACE_OP_WRITE]            = "write",
+    [TRACE_OP_FLUSH]            = "flush",
+    [TRACE_OP_FSYNC]            = "fsync",
+    [TRACE_OP_RELEASE]          = "release",
+    [TRACE_OP_READDIR]          = "readdir",
+    [TRACE_OP_RENAME]           = "rename",
+    [TRACE_OP_GIT]              = "git",
+    [TRACE_OP_NOTIFY_SKIP]      = "notify-skip",
+    [TRACE_OP_PULL]             = "pull",
+    [TRACE_OP_MERGE_CONFLICT]   = "merge-conflict",
+    [TRACE_OP_COMMIT]           = "commit",
+    [TRACE_OP_DISCONNECT]       = "disconnect",
+    [TRACE_OP_CLIENT_ADD]       = "client-add",
+    [TRACE_OP_CLIENT_REMOVE]    = "client-remove",
+    [TRACE_OP_HOOK_RECV]        = "hook-recv",
+    [TRACE_OP_SEND]             = "send",
+    [TRACE_OP_BROADCAST]        = "broadcast",
+    [TRACE_OP_MAINTENANCE]      = "maintenance",
+    [TRACE_OP_REPLAY]           = "replay",
+    [TRACE_OP_RESET]            = "reset",
+    [TRACE_OP_CONNECT]          = "connect",
+    [TRACE_OP_HEARTBEAT]        = "heartbeat",
+    [TRACE_OP_COALESCE]         = "coalesce",
+    [TRACE_OP_CHUNK_STORE]      = "chunk-store",
+    [TRACE_OP_PREFETCH]         = "prefetch",
+    [TRACE_OP_UPSTREAM_CONNECT] = "upstream-connect",
+    [TRACE_OP_UPSTREAM_LOST]    = "upstream-lost",
+    [TRACE_OP_RELAY]            = "relay",
+    [TRACE_OP_RELAY_LOOP]       = "relay-loop",
+    [TRACE_OP_CLIENT_OVERFLOW]  = "client-overflow",
+};
+
+static const char *level_names[] = { "off", "error", "info", "debug" };
+
+const char *vcfs_trace_op_name(int op)
+{
+    if (op < 0 || op >= TRACE_OP_COUNT || op_names[op] == NULL) {
+        return "unknown";
+    }
+    return op_names[op];
+}
+
+const char *vcfs_trace_level_name(int level)
+{
+    if (level < 0 || level > TRACE_DEBUG) {
+        return "unknown";
+    }
+    return level_names[level];
+}
+
+uint64_t vcfs_trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void release_ring(void *ring)
+{
+    atomic_store_explicit(&((trace_ring *)ring)->in_use, false, memory_order_release);
+}
+
+static trace_ring *get_ring(void)
+{
+    if (my_ring != NULL) {
+        return my_ring;
+    }
+
+    uint32_t tid = (uint32_t)syscall(SYS_gettid);
+
+    // Reuse a ring left behind by a thread which has exited.
+    for (trace_ring *r = atomic_load(&rings); r != NULL; r = r->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&r->in_use, &expected, true)) {
+            r->tid = tid;
+            my_ring = r;
+            pthread_setspecific(ring_key, r);
+            return r;
+        }
+    }
+
+    trace_ring *r = (trace_ring *)calloc(1, sizeof(trace_ring));
+    if (r == NULL) {
+        return NULL;
+    }
+    atomic_init(&r->in_use, true);
+    r->tid = tid;
+
+    trace_ring *head = atomic_load(&rings);
+    do {
+        r->next = head;
+    } while (!atomic_compare_exchange_weak(&rings, &head, r));
+
+    my_ring = r;
+    pthread_setspecific(ring_key, r);
+    return r;
+}
+
+void vcfs_trace_emit(int level, int op, uint64_t start_ns, int64_t arg,
+                     const char *str, size_t str_len)
+{
+    trace_ring *r = get_ring();
+    if (r == NULL) {
+        return;
+    }
+
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head - tail == TRACE_RING_SIZE) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    vcfs_trace_record *rec = &r->records[head & (TRACE_RING_SIZE - 1)];
+    rec->timestamp_ns = vcfs_trace_now();
+    rec->duration_ns = start_ns ? rec->timestamp_ns - start_ns : 0;
+    rec->arg = arg;
+    rec->tid = r->tid;
+    rec->op = op;
+    rec->level = level;
+    if (str_len > VCFS_TRACE_STR_LEN) {
+        str_len = VCFS_TRACE_STR_LEN;
+    }
+    rec->str_len = str_len;
+    if (str_len) {
+        memcpy(rec->str, str, str_len);
+    }
+
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+static void drain_rings(void)
+{
+    for (trace_ring *r = atomic_load(&rings); r != NULL; r = r->next) {
+        uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+        while (tail != head) {
+            // Write the contiguous part of the ring up to its end in one go.
+            uint64_t start = tail & (TRACE_RING_SIZE - 1);
+            uint64_t count = head - tail;
+            if (start + count > TRACE_RING_SIZE) {
+                count = TRACE_RING_SIZE - start;
+            }
+            fwrite(&r->records[start], sizeof(vcfs_trace_record), count, trace_file);
+            tail += count;
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+
+        uint64_t dropped = atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+        if (dropped) {
+            // Record the loss in the file itself so gaps are explained.
+            vcfs_trace_record rec = {0};
+            rec.timestamp_ns = vcfs_trace_now();
+            rec.arg = dropped;
+            rec.tid = r->tid;
+            rec.op = TRACE_OP_NONE;
+            rec.level = TRACE_ERROR;
+            rec.str_len = sizeof("dropped") - 1;
+            memcpy(rec.str, "dropped", rec.str_len);
+            fwrite(&rec, sizeof(rec), 1, trace_file);
+        }
+    }
+    fflush(trace_file);
+}
+
+static void *drain_main(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&drain_lock);
+    while (!drain_stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += TRACE_DRAIN_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&drain_cond, &drain_lock, &deadline);
+
+        pthread_mutex_unlock(&drain_lock);
+        drain_rings();
+        pthread_mutex_lock(&drain_lock);
+    }
+    pthread_mutex_unlock(&drain_lock);
+
+    drain_rings();
+    return NULL;
+}
+
+int vcfs_trace_parse_level(const char *level)
+{
+    for (int i = TRACE_OFF; i <= TRACE_DEBUG; ++i) {
+        if (strcasecmp(level, level_names[i]) == 0) {
+            return i;
+        }
+    }
+    char *end;
+    long n = strtol(level, &end, 10);
+    if (*level == '\0' || *end != '\0' || n < 0 || n > INT_MAX) {
+        return -1;
+    }
+    return (int)n;
+}
+
+void vcfs_trace_resolve_path(void)
+{
+    const char *path = getenv("VCFS_TRACE_FILE");
+    if (path == NULL || path[0] == '/') {
+        return;
+    }
+
+    char cwd[PATH_MAX];
+    char *abs_path;
+    if (getcwd(cwd, sizeof(cwd)) == NULL || asprintf(&abs_path, "%s/%s", cwd, path) < 0) {
+        perror("trace file");
+        return;
+    }
+    setenv("VCFS_TRACE_FILE", abs_path, 1);
+    free(abs_path);
+}
+
+void vcfs_trace_init(const char *component)
+{
+    const char *path = getenv("VCFS_TRACE_FILE");
+    if (path == NULL) {
+        return;
+    }
+
+    const char *level_env = getenv("VCFS_TRACE_LEVEL");
+    int level = level_env ? vcfs_trace_parse_level(level_env) : TRACE_INFO;
+    if (level <= TRACE_OFF) {
+        return;
+    }
+
+    trace_file = fopen(path, "w");
+    if (trace_file == NULL) {
+        perror("trace file");
+        return;
+    }
+
+    vcfs_trace_header header = {0};
+    memcpy(header.magic, VCFS_TRACE_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(vcfs_trace_record);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.realtime_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    header.monotonic_ns = vcfs_trace_now();
+    strncpy(header.component, component, sizeof(header.component) - 1);
+    fwrite(&header, sizeof(header), 1, trace_file);
+
+    pthread_key_create(&ring_key, release_ring);
+    if (pthread_create(&drain_thread, NULL, drain_main, NULL)) {
+        perror("trace thread");
+        fclose(trace_file);
+        trace_file = NULL;
+        return;
+    }
+
+    // Don't lose the tail of the trace when the process exits.
+    atexit(vcfs_trace_shutdown);
+
+    vcfs_trace_level_enabled = level > TRACE_DEBUG ? TRACE_DEBUG : level;
+}
+
+void vcfs_trace_shutdown(void)
+{
+    if (trace_file == NULL) {
+        return;
+    }
+
+    vcfs_trace_level_enabled = TRACE_OFF;
+
+    pthread_mutex_lock(&drain_lock);
+    drain_stopping = true;
+    pthread_cond_signal(&drain_cond);
+    pthread_mutex_unlock(&drain_lock);
+    pthread_join(drain_thread, NULL);
+
+    fclose(trace_file);
+    trace_file = NULL;
+}
@@ -0,0 +1,191 @@
+#ifndef VCFS_TRACE_H
+#define VCFS_TRACE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Binary tracing shared by the client and the server.
+ *
+ * Each thread appends fixed-size records to its own single-producer ring
+ * buffer without taking any locks, and a background thread drains every ring
+ * to the file named by VCFS_TRACE_FILE. VCFS_TRACE_LEVEL selects how much is
+ * recorded (error, info or debug; info by default). Without VCFS_TRACE_FILE
+ * nothing is recorded. Use vcfs-trace to decode the file.
+ */
+
+typedef enum vcfs_trace_level
+{
+    TRACE_OFF = 0,
+    TRACE_ERROR,
+    TRACE_INFO,
+    TRACE_DEBUG,
+} vcfs_trace_level;
+
+/* Op codes are part of the file format: only ever append to this list. */
+typedef enum vcfs_trace_op
+{
+    TRACE_OP_NONE = 0,
+
+    /* client: FUSE operations */
+    TRACE_OP_GETATTR,
+    TRACE_OP_OPEN,
+    TRACE_OP_READ,
+    TRACE_OP_WRITE,
+    TRACE_OP_FLUSH,
+    TRACE_OP_FSYNC,
+    TRACE_OP_RELEASE,
+    TRACE_OP_READDIR,
+    TRACE_OP_RENAME,
+
+    /* client: commit worker */
+    TRACE_OP_GIT,
+    TRACE_OP_NOTIFY_SKIP,
+    TRACE_OP_PULL,
+    TRACE_OP_MERGE_CONFLICT,
+    TRACE_OP_COMMIT,
+    TRACE_OP_DISCONNECT,
+
+    /* server */
+    TRACE_OP_CLIENT_ADD,
+    TRACE_OP_CLIENT_REMOVE,
+    TRACE_OP_HOOK_RECV,
+    TRACE_OP_SEND,
+    TRACE_OP_BROADCAST,
+    TRACE_OP_MAINTENANCE,
+    TRACE_OP_REPLAY,
+    TRACE_OP_RESET,
+    TRACE_OP_CONNECT,
+    TRACE_OP_HEARTBEAT,
+    TRACE_OP_COALESCE,
+
+    /* client: chunked files */
+    TRACE_OP_CHUNK_STORE,
+
+    /* client: prefetch */
+    TRACE_OP_PREFETCH,
+
+    /* server: relay mode */
+    TRACE_OP_UPSTREAM_CONNECT,
+    TRACE_OP_UPSTREAM_LOST,
+    TRACE_OP_RELAY,
+    TRACE_OP_RELAY_LOOP,
+
+    /* server: slow clients */
+    TRACE_OP_CLIENT_OVERFLOW,
+
+    TRACE_OP_COUNT
+} vcfs_trace_op;
+
+#define VCFS_TRACE_MAGIC    "VCFSTRC1"
+#define VCFS_TRACE_STR_LEN  32
+
+typedef struct vcfs_trace_header
+{
+    char        magic[8];
+    uint32_t    record_size;
+    uint32_t    reserved;
+    /* CLOCK_REALTIME and CLOCK_MONOTONIC sampled together at startup, so
+       record timestamps (monotonic) can be turned into wall clock times. */
+    uint64_t    realtime_ns;
+    uint64_t    monotonic_ns;
+    char        component[16];
+} vcfs_trace_header;
+
+typedef struct vcfs_trace_record
+{
+    uint64_t    timestamp_ns;
+    uint64_t    duration_ns;
+    int64_t     arg;
+    uint32_t    tid;
+    uint16_t    op;
+    uint8_t     level;
+    uint8_t     str_len;
+    char        str[VCFS_TRACE_STR_LEN];
+} vcfs_trace_record;
+
+extern atomic_int vcfs_trace_level_enabled;
+
+/**
+ * Start tracing for this process. `component` is recorded in the file header.
+ * This starts the drain thread, so it must be called after the process has
+ * finished daemonizing.
+ */
+void vcfs_trace_init(const char *component);
+
+/**
+ * Make a relative VCFS_TRACE_FILE absolute, so that it still names the same
+ * file once the process has daemonized and changed to the root directory.
+ */
+void vcfs_trace_resolve_path(void);
+
+/**
+ * Drain all buffered records and stop the background thread.
+ */
+void vcfs_trace_shutdown(void);
+
+uint64_t vcfs_trace_now(void);
+
+/**
+ * Append a record to the calling thread's ring. If `start_ns` is not zero the
+ * record's duration is the time elapsed since then. Records are dropped, not
+ * blocked on, when the ring is full.
+ */
+void vcfs_trace_emit(int level, int op, uint64_t start_ns, int64_t arg,
+                     const char *str, size_t str_len);
+
+const char *vcfs_trace_op_name(int op);
+const char *vcfs_trace_level_name(int level);
+
+/**
+ * Parse a level given by name (off, error, info or debug, in any case) or by
+ * number.
+ *
+ * Returns the level, or -1 if it is neither.
+ */
+int vcfs_trace_parse_level(const char *level);
+
+static inline bool vcfs_trace_enabled(int level)
+{
+    return level <= atomic_load_explicit(&vcfs_trace_level_enabled, memory_order_relaxed);
+}
+
+static inline size_t vcfs_trace_strlen(const char *str)
+{
+    return str ? strlen(str) : 0;
+}
+
+/* Returns a start time for TRACE_SPAN, or 0 if `level` is not recorded. */
+static inline uint64_t vcfs_trace_start(int level)
+{
+    return vcfs_trace_enabled(level) ? vcfs_trace_now() : 0;
+}
+
+#define TRACE(level, op, arg) \
+    do { \
+        if (vcfs_trace_enabled(level)) \
+            vcfs_trace_emit(level, op, 0, arg, NULL, 0); \
+    } while (0)
+
+#define TRACE_STR(level, op, arg, str) \
+    do { \
+        if (vcfs_trace_enabled(level)) \
+            vcfs_trace_emit(level, op, 0, arg, str, strlen(str)); \
+    } while (0)
+
+#define TRACE_STRN(level, op, arg, str, len) \
+    do { \
+        if (vcfs_trace_enabled(level)) \
+            vcfs_trace_emit(level, op, 0, arg, str, len); \
+    } while (0)
+
+#define TRACE_SPAN(level, op, start, arg, str) \
+    do { \
+        if ((start) != 0) \
+            vcfs_trace_emit(level, op, start, arg, str, vcfs_trace_strlen(str)); \
+    } while (0)
+
+#endif
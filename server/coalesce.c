@@ -0,0 +1,112 @@
+#include "coalesce.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+typedef struct pending_notification
+{
+    char                           *msg;
+    size_t                          len;
+    // Length of the branch name at the start of msg.
+    size_t                          branch_len;
+    uint64_t                        first_ms;
+    uint64_t                        last_ms;
+    int                             pushes;
+    struct pending_notification    *next;
+} pending_notification;
+
+// In the order their bursts started: new ones go on the end.
+static pending_notification *pending = NULL;
+static int window;
+static int max_delay;
+
+void coalesce_init(int window_ms, int max_delay_ms)
+{
+    window = window_ms < 0 ? 0 : window_ms;
+    max_delay = max_delay_ms < window ? window : max_delay_ms;
+}
+
+static uint64_t due(const pending_notification *p)
+{
+    uint64_t quiet = p->last_ms + window;
+    uint64_t limit = p->first_ms + max_delay;
+    return quiet < limit ? quiet : limit;
+}
+
+void coalesce_add(const char *msg, size_t len, uint64_t now_ms)
+{
+    const char *space = memchr(msg, ' ', len);
+    size_t branch_len = space ? (size_t)(space - msg) : len;
+
+    pending_notification **tail = &pending;
+    for (pending_notification *p = pending; p; p = p->next) {
+        if (p->branch_len == branch_len && memcmp(p->msg, msg, branch_len) == 0) {
+            char *copy = (char *)malloc(len);
+            if (copy == NULL) {
+                perror("malloc");
+                return;
+            }
+            memcpy(copy, msg, len);
+            free(p->msg);
+            p->msg = copy;
+            p->len = len;
+            p->last_ms = now_ms;
+            ++p->pushes;
+            return;
+        }
+        tail = &p->next;
+    }
+
+    pending_notification *p = (pending_notification *)malloc(sizeof(pending_notification));
+    char *copy = (char *)malloc(len);
+    if (p == NULL || copy == NULL) {
+        perror("malloc");
+        free(p);
+        free(copy);
+        return;
+    }
+    memcpy(copy, msg, len);
+    p->msg = copy;
+    p->len = len;
+    p->branch_len = branch_len;
+    p->first_ms = now_ms;
+    p->last_ms = now_ms;
+    p->pushes = 1;
+    p->next = NULL;
+    *tail = p;
+}
+
+void coalesce_flush(uint64_t now_ms, coalesce_send_fn send)
+{
+    pending_notification **link = &pending;
+    while (*link) {
+        pending_notification *p = *link;
+        if (due(p) > now_ms) {
+            link = &p->next;
+            continue;
+        }
+
+        TRACE(TRACE_INFO, TRACE_OP_COALESCE, p->pushes);
+        send(p->msg, p->len);
+
+        *link = p->next;
+        free(p->msg);
+        free(p);
+    }
+}
+
+int coalesce_timeout(uint64_t now_ms)
+{
+    int timeout = -1;
+    for (pending_notification *p = pending; p; p = p->next) {
+        uint64_t at = due(p);
+        int ms = at > now_ms ? (int)(at - now_ms) : 0;
+        if (timeout < 0 || ms < timeout) {
+            timeout = ms;
+        }
+    }
+    return timeout;
+}
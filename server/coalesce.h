@@ -0,0 +1,39 @@
+#ifndef VCFS_COALESCE_H
+#define VCFS_COALESCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Collapse bursts of pushes to the same branch into a single notification.
+ *
+ * Hook messages are "<branch>" or "<branch> <sha>". A message for a branch
+ * which already has one pending replaces it, so only the latest SHA is sent.
+ * A branch's notification goes out once no push for it has arrived for
+ * `window_ms`, or `max_delay_ms` after the first push of the burst, whichever
+ * comes first. So a quiet branch can go out before a busy one whose burst
+ * started earlier; notifications which fall due together are sent in the
+ * order their bursts started.
+ */
+
+typedef void (*coalesce_send_fn)(const char *msg, size_t len);
+
+void coalesce_init(int window_ms, int max_delay_ms);
+
+/**
+ * Queue a hook message received at `now_ms`.
+ */
+void coalesce_add(const char *msg, size_t len, uint64_t now_ms);
+
+/**
+ * Pass every notification which is due at `now_ms` to `send`.
+ */
+void coalesce_flush(uint64_t now_ms, coalesce_send_fn send);
+
+/**
+ * Returns the number of milliseconds until the next notification is due, or
+ * -1 if none are pending.
+ */
+int coalesce_timeout(uint64_t now_ms);
+
+#endif
@@ -8,15 +8,19 @@
 
 int main(int argc, char **argv)
 {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <ip> <port> <branch>\n", argv[0]);
+    if (argc != 4 && argc != 5) {
+        fprintf(stderr, "Usage: %s <ip> <port> <branch> [<sha>]\n", argv[0]);
         return 1;
     }
 
     const char *ip_str = argv[1];
     int port = atoi(argv[2]);
     const char *branch_name = argv[3];
-    uint32_t branch_name_len = strlen(branch_name);
+    const char *sha = argc == 5 ? argv[4] : NULL;
+    // The message is the branch name, followed by a space and the new SHA if
+    // we know it, so the server can coalesce pushes and clients can skip
+    // fetching commits they already have.
+    uint32_t msg_len = strlen(branch_name) + (sha ? 1 + strlen(sha) : 0);
 
     int ip_bytes[4];
     if (sscanf(ip_str, "%d.%d.%d.%d", ip_bytes, ip_bytes + 1, ip_bytes + 2, ip_bytes + 3) != 4) {
@@ -42,10 +46,20 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    ssize_t bufsize = sizeof(uint32_t) + branch_name_len;
+    ssize_t bufsize = sizeof(uint32_t) + msg_len + 1;
     char * buf = malloc(bufsize);
-    *(uint32_t *)buf = htonl(branch_name_len);
-    strncpy(buf + sizeof(uint32_t), branch_name, branch_name_len);
+    if (buf == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    *(uint32_t *)buf = htonl(msg_len);
+    if (sha) {
+        snprintf(buf + sizeof(uint32_t), msg_len + 1, "%s %s", branch_name, sha);
+    } else {
+        snprintf(buf + sizeof(uint32_t), msg_len + 1, "%s", branch_name);
+    }
+    // Don't send the terminator snprintf added.
+    --bufsize;
 
     if (write(sockfd, buf, bufsize) != bufsize) {
         perror("write");
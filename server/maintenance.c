@@ -0,0 +1,233 @@
+#include "maintenance.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+// From linux/ioprio.h, which is not always installed.
+#define IOPRIO_WHO_PROCESS  1
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_CLASS_SHIFT  13
+
+// The git commands of one maintenance run, and the most arguments any takes.
+#define MAINT_STEPS     4
+#define MAINT_MAX_ARGS  16
+
+typedef struct maintenance
+{
+    const char *git_dir;
+    int         push_threshold;
+    int         quiet_secs;
+    int         interval_secs;
+    int         max_defer_secs;
+    const char *prune_expire;
+
+    // Everything the child needs, prepared before forking since the child
+    // of a threaded process may only make async-signal-safe calls.
+    char        git_dir_opt[PATH_MAX + 16];
+    char        prune_opt[256];
+    char       *steps[MAINT_STEPS][MAINT_MAX_ARGS];
+    long        max_fd;
+
+    int         pushes;
+    // The first push since the last run, and the latest.
+    time_t      first_push;
+    time_t      last_push;
+    time_t      last_run;
+    uint64_t    started;
+    pid_t       pid;
+} maintenance;
+
+static maintenance maint;
+
+static int env_int(const char *name, int dflt)
+{
+    const char *value = getenv(name);
+    return value ? atoi(value) : dflt;
+}
+
+/**
+ * Set up step `i` to run `git --git-dir=<git_dir> <args...>`.
+ */
+static void set_step(int i, char *const args[])
+{
+    char **argv = maint.steps[i];
+    int argc = 0;
+    argv[argc++] = "git";
+    argv[argc++] = maint.git_dir_opt;
+    argv[argc++] = "-c";
+    argv[argc++] = "pack.threads=1";
+    for (int j = 0; args[j] != NULL && argc < MAINT_MAX_ARGS - 1; ++j) {
+        argv[argc++] = args[j];
+    }
+    argv[argc] = NULL;
+}
+
+void maintenance_init(const char *git_dir)
+{
+    maint.git_dir = git_dir;
+    maint.push_threshold = env_int("VCFS_MAINT_PUSHES", 50);
+    maint.quiet_secs = env_int("VCFS_MAINT_QUIET", 30);
+    maint.interval_secs = env_int("VCFS_MAINT_INTERVAL", 600);
+    maint.max_defer_secs = env_int("VCFS_MAINT_MAX_DEFER", 3600);
+    maint.prune_expire = getenv("VCFS_MAINT_PRUNE_EXPIRE");
+    if (maint.prune_expire == NULL) {
+        maint.prune_expire = "2.weeks.ago";
+    }
+
+    snprintf(maint.git_dir_opt, sizeof(maint.git_dir_opt), "--git-dir=%s", git_dir ? git_dir : "");
+    snprintf(maint.prune_opt, sizeof(maint.prune_opt), "--expire=%s", maint.prune_expire);
+    // Geometric repacking only rewrites the small packs left by recent pushes,
+    // so each run stays cheap however large the history gets.
+    set_step(0, (char *[]){ "repack", "-d", "-q", "--geometric=2", "--write-midx",
+                            "--write-bitmap-index", NULL });
+    set_step(1, (char *[]){ "commit-graph", "write", "--reachable", "--split", NULL });
+    set_step(2, (char *[]){ "prune-packed", "-q", NULL });
+    set_step(3, (char *[]){ "prune", maint.prune_opt, NULL });
+
+    maint.max_fd = sysconf(_SC_OPEN_MAX);
+    if (maint.max_fd < 0 || maint.max_fd > 65536) {
+        maint.max_fd = 65536;
+    }
+}
+
+void maintenance_note_push(void)
+{
+    if (maint.pushes++ == 0) {
+        maint.first_push = time(NULL);
+    }
+    maint.last_push = time(NULL);
+}
+
+/**
+ * Returns the time at which maintenance should start, or 0 if none is due.
+ */
+static time_t maintenance_due(void)
+{
+    if (maint.git_dir == NULL || maint.push_threshold <= 0
+            || maint.pushes < maint.push_threshold) {
+        return 0;
+    }
+
+    time_t due = maint.last_push + maint.quiet_secs;
+    // With pushes arriving steadily the quiet period never comes, so don't
+    // wait for it forever.
+    if (maint.max_defer_secs > 0 && maint.first_push + maint.max_defer_secs < due) {
+        due = maint.first_push + maint.max_defer_secs;
+    }
+    if (maint.last_run && maint.last_run + maint.interval_secs > due) {
+        due = maint.last_run + maint.interval_secs;
+    }
+    return due;
+}
+
+/**
+ * Run the git command `argv` and wait for it. Only called from the
+ * maintenance child.
+ */
+static int run_git(char *const argv[])
+{
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        execvp("git", argv);
+        _exit(127);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/**
+ * Body of the maintenance child. Runs at the lowest CPU and I/O priority so
+ * that fetches served by the same machine are not slowed down. Only makes
+ * async-signal-safe calls, as the server has other threads.
+ */
+static void maintenance_child(void)
+{
+    // Don't hold on to the server's sockets, or a restarted server could not
+    // bind its ports until we finish.
+    for (long fd = STDERR_FILENO + 1; fd < maint.max_fd; ++fd) {
+        close(fd);
+    }
+
+    // Both are plain system calls, so safe here.
+    setpriority(PRIO_PROCESS, 0, 19);
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+
+    int res = 0;
+    for (int i = 0; i < MAINT_STEPS; ++i) {
+        res |= run_git(maint.steps[i]);
+    }
+
+    // Skip atexit handlers: they belong to the server.
+    _exit(res ? 1 : 0);
+}
+
+void maintenance_poll(void)
+{
+    if (maint.pid) {
+        int status;
+        pid_t pid = waitpid(maint.pid, &status, WNOHANG);
+        if (pid == 0) {
+            return;
+        }
+        int res = (pid > 0 && WIFEXITED(status)) ? WEXITSTATUS(status) : -1;
+        TRACE_SPAN(TRACE_INFO, TRACE_OP_MAINTENANCE, maint.started, res, "done");
+        maint.pid = 0;
+    }
+
+    time_t due = maintenance_due();
+    if (due == 0 || time(NULL) < due) {
+        return;
+    }
+
+    maint.started = vcfs_trace_start(TRACE_INFO);
+    TRACE(TRACE_INFO, TRACE_OP_MAINTENANCE, maint.pushes);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork maintenance");
+        return;
+    }
+    if (pid == 0) {
+        maintenance_child();
+    }
+
+    maint.pid = pid;
+    maint.pushes = 0;
+    maint.last_run = time(NULL);
+}
+
+int maintenance_timeout(void)
+{
+    if (maint.pid) {
+        // Check back for the child.
+        return 1;
+    }
+
+    time_t due = maintenance_due();
+    if (due == 0) {
+        return -1;
+    }
+
+    time_t now = time(NULL);
+    return due > now ? (int)(due - now) : 0;
+}
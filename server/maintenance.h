@@ -0,0 +1,47 @@
+#ifndef VCFS_MAINTENANCE_H
+#define VCFS_MAINTENANCE_H
+
+/**
+ * Background maintenance of the bare repository the server sits in front of.
+ *
+ * Every automated commit arrives as a push, which leaves behind loose objects
+ * and small packs that make each client fetch slower. After a burst of pushes
+ * has died down (or has gone on too long), the server forks a low-priority child which repacks
+ * geometrically into a multi-pack-index with a reachability bitmap, writes a
+ * split commit-graph and prunes loose objects.
+ *
+ * Configured through the environment:
+ *   VCFS_MAINT_PUSHES        pushes before maintenance is due (default 50,
+ *                            0 disables maintenance)
+ *   VCFS_MAINT_QUIET         seconds without a push before it starts (30)
+ *   VCFS_MAINT_MAX_DEFER     seconds after the first pending push by which
+ *                            it starts even if pushes keep coming (3600,
+ *                            0 to always wait for a quiet period)
+ *   VCFS_MAINT_INTERVAL      minimum seconds between runs (600)
+ *   VCFS_MAINT_PRUNE_EXPIRE  age of unreachable objects to prune
+ *                            (2.weeks.ago)
+ */
+
+/**
+ * Enable maintenance of the repository at `git_dir`.
+ */
+void maintenance_init(const char *git_dir);
+
+/**
+ * Record that a push was received.
+ */
+void maintenance_note_push(void);
+
+/**
+ * Reap a finished maintenance run and start a new one if one is due. Call
+ * this every time the server wakes up.
+ */
+void maintenance_poll(void);
+
+/**
+ * Returns how many seconds the server may sleep before maintenance_poll needs
+ * to be called again, or -1 if it can wait for the next event.
+ */
+int maintenance_timeout(void);
+
+#endif
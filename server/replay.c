@@ -0,0 +1,92 @@
+#include "replay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "protocol.h"
+
+static replay_entry *entries = NULL;
+static size_t capacity = 0;
+static uint64_t last_seq = 0;
+
+void replay_init(size_t cap)
+{
+    if (cap == 0) {
+        cap = 1;
+    }
+    entries = (replay_entry *)calloc(cap, sizeof(replay_entry));
+    if (entries == NULL) {
+        perror("malloc");
+        abort();
+    }
+    capacity = cap;
+}
+
+const replay_entry *replay_append(vcfs_msg_type type, const char *body, size_t body_len,
+                                  const uint64_t *route, size_t n_route)
+{
+    size_t frame_body_len = sizeof(uint64_t) + body_len;
+    size_t relay_body_len = sizeof(uint64_t) + 2 + n_route * sizeof(uint64_t) + body_len;
+    char *frame = (char *)malloc(VCFS_FRAME_HEADER_SIZE + frame_body_len);
+    char *relay_frame = (char *)malloc(VCFS_FRAME_HEADER_SIZE + relay_body_len);
+    if (frame == NULL || relay_frame == NULL) {
+        perror("malloc");
+        free(frame);
+        free(relay_frame);
+        return NULL;
+    }
+
+    uint64_t seq = last_seq + 1;
+    size_t off = vcfs_put_frame_header(frame, type, frame_body_len);
+    vcfs_put_u64(frame + off, seq);
+    memcpy(frame + off + sizeof(uint64_t), body, body_len);
+
+    off = vcfs_put_frame_header(relay_frame, VCFS_MSG_RELAY, relay_body_len);
+    vcfs_put_u64(relay_frame + off, seq);
+    off += sizeof(uint64_t);
+    relay_frame[off++] = (char)type;
+    relay_frame[off++] = (char)n_route;
+    for (size_t i = 0; i < n_route; ++i) {
+        vcfs_put_u64(relay_frame + off, route[i]);
+        off += sizeof(uint64_t);
+    }
+    memcpy(relay_frame + off, body, body_len);
+
+    replay_entry *e = &entries[seq % capacity];
+    free(e->frame);
+    free(e->relay_frame);
+    e->seq = seq;
+    e->frame = frame;
+    e->frame_len = VCFS_FRAME_HEADER_SIZE + frame_body_len;
+    e->relay_frame = relay_frame;
+    e->relay_frame_len = VCFS_FRAME_HEADER_SIZE + relay_body_len;
+    memcpy(e->route, route, n_route * sizeof(uint64_t));
+    e->n_route = n_route;
+
+    last_seq = seq;
+    return e;
+}
+
+const replay_entry *replay_get(uint64_t seq)
+{
+    if (seq == 0 || seq > last_seq) {
+        return NULL;
+    }
+    replay_entry *e = &entries[seq % capacity];
+    return e->seq == seq ? e : NULL;
+}
+
+uint64_t replay_last_seq(void)
+{
+    return last_seq;
+}
+
+int replay_can_resume(uint64_t seq)
+{
+    if (seq > last_seq) {
+        return 0;
+    }
+    // Everything after `seq` must still be in the log.
+    return seq == last_seq || replay_get(seq + 1) != NULL;
+}
@@ -0,0 +1,64 @@
+#ifndef VCFS_REPLAY_H
+#define VCFS_REPLAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+/**
+ * Bounded log of the most recent notifications, so that clients which lose
+ * their connection can catch up on what they missed when they reconnect.
+ *
+ * Sequence numbers start at 1 and increase by one for every notification.
+ * Only the last `capacity` notifications are kept. A relay also logs the
+ * RESETs it passes on, so clients which were away see them too.
+ */
+
+typedef struct replay_entry
+{
+    uint64_t    seq;
+    // The complete NOTIFY or RESET frame, ready to be sent to clients.
+    char       *frame;
+    size_t      frame_len;
+    // The same message as a RELAY frame, for relays.
+    char       *relay_frame;
+    size_t      relay_frame_len;
+    // The servers it has passed through, this one first.
+    uint64_t    route[VCFS_MAX_HOPS];
+    size_t      n_route;
+} replay_entry;
+
+void replay_init(size_t capacity);
+
+/**
+ * Assign the next sequence number to a message of `type` (NOTIFY or RESET)
+ * and add it to the log, evicting the oldest entry if the log is full.
+ * `body` is the body of the message after its sequence number, and `route`
+ * the servers it has passed through, this one first; `n_route` must be
+ * between 1 and VCFS_MAX_HOPS.
+ *
+ * Returns the new entry, or NULL if it could not be allocated.
+ */
+const replay_entry *replay_append(vcfs_msg_type type, const char *body, size_t body_len,
+                                  const uint64_t *route, size_t n_route);
+
+/**
+ * Returns the entry with sequence number `seq`, or NULL if it is not (or no
+ * longer) in the log.
+ */
+const replay_entry *replay_get(uint64_t seq);
+
+/**
+ * Returns the sequence number of the last notification, or 0 if there has
+ * been none.
+ */
+uint64_t replay_last_seq(void);
+
+/**
+ * Returns whether a client which has seen everything up to and including
+ * `seq` can be brought up to date from the log.
+ */
+int replay_can_resume(uint64_t seq);
+
+#endif
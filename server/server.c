@@ -1,24 +1,59 @@
+#include <fcntl.h>
 #include <netinet/ip.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 
-#define LOG(fmt, ...) printf(fmt "\n", ##__VA_ARGS__)
+#include "coalesce.h"
+#include "maintenance.h"
+#include "protocol.h"
+#include "replay.h"
+#include "trace.h"
+#include "upstream.h"
+
+#define HELLO_FRAME_SIZE (VCFS_FRAME_HEADER_SIZE + 2 * sizeof(uint64_t))
+#define RELAY_HELLO_FRAME_SIZE (VCFS_FRAME_HEADER_SIZE + 3 * sizeof(uint64_t))
+// How much may be waiting to be sent to one client. A client which falls
+// further behind is disconnected rather than holding up everyone else, and
+// catches up from the replay log, or with a RESET, when it reconnects.
+#define CLIENT_QUEUE_SIZE (64 * 1024)
 
 typedef struct client_connection
 {
     int                         fd;
+    // Clients only receive notifications once they have said hello.
+    bool                        greeted;
+    char                        hello[RELAY_HELLO_FRAME_SIZE];
+    size_t                      hello_len;
+    // Set for relays (see upstream.h), which are sent RELAY frames.
+    bool                        relay;
+    uint64_t                    node_id;
+    // What the socket would not take yet, allocated when first needed.
+    char                       *out;
+    size_t                      out_len;
     struct client_connection   *prev;
     struct client_connection   *next;
 } client_connection;
 
 client_connection *clients = NULL;
 
+// Identifies this run of the server, so clients can tell that sequence
+// numbers they remember are from before a restart.
+uint64_t epoch;
+// Names this server in the routes of relayed messages. Both are random, so
+// they are unique across hosts as well as across runs.
+uint64_t node_id;
+int heartbeat_secs;
+time_t last_sent;
+
 /**
  * Initialie a TCP server at the given port and begin listening for connections.
  *
@@ -64,6 +99,12 @@ void add_client(int fd)
     }
 
     conn->fd = fd;
+    conn->greeted = false;
+    conn->hello_len = 0;
+    conn->relay = false;
+    conn->node_id = 0;
+    conn->out = NULL;
+    conn->out_len = 0;
     if (clients) {
         clients->prev = conn;
     }
@@ -90,20 +131,356 @@ client_connection * remove_client(client_connection *c)
     client_connection *next = c->next;
 
     close(c->fd);
+    free(c->out);
     free(c);
 
     return next;
 }
 
+/**
+ * Write as much of `buf` to a client's socket as it will take without
+ * blocking.
+ *
+ * Returns the number of bytes written, or -1 if the client should be removed.
+ */
+ssize_t write_some(client_connection *c, const char *buf, size_t len)
+{
+    ssize_t n;
+    do {
+        n = send(c->fd, buf, len, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    if (n < 0 && errno != EPIPE && errno != ECONNRESET) {
+        perror("send");
+    }
+    return n;
+}
+
+/**
+ * Returns whether `len` more bytes fit in a client's queue.
+ */
+bool queue_fits(const client_connection *c, size_t len)
+{
+    return c->out_len + len <= CLIENT_QUEUE_SIZE;
+}
+
+/**
+ * Send a whole frame to a client, queueing whatever the socket won't take
+ * yet.
+ *
+ * Returns 0 on success, or -1 if the client should be removed.
+ */
+int send_frame(client_connection *c, const char *buf, size_t len)
+{
+    // Nothing may overtake what is already queued.
+    if (c->out_len == 0) {
+        ssize_t n = write_some(c, buf, len);
+        if (n < 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        if (len == 0) {
+            return 0;
+        }
+    }
+
+    if (!queue_fits(c, len)) {
+        TRACE(TRACE_ERROR, TRACE_OP_CLIENT_OVERFLOW, c->fd);
+        return -1;
+    }
+    if (c->out == NULL) {
+        c->out = (char *)malloc(CLIENT_QUEUE_SIZE);
+        if (c->out == NULL) {
+            perror("malloc");
+            return -1;
+        }
+    }
+    memcpy(c->out + c->out_len, buf, len);
+    c->out_len += len;
+    return 0;
+}
+
+/**
+ * Send a client as much of its queue as its socket will take.
+ *
+ * Returns 0 on success, or -1 if the client should be removed.
+ */
+int flush_client(client_connection *c)
+{
+    ssize_t n = write_some(c, c->out, c->out_len);
+    if (n < 0) {
+        return -1;
+    }
+    memmove(c->out, c->out + n, c->out_len - n);
+    c->out_len -= n;
+    return 0;
+}
+
+/**
+ * Returns the size of the frame a client is sent for a logged message, or 0
+ * if it is a relay the message has already passed through.
+ */
+size_t entry_len(const client_connection *c, const replay_entry *e)
+{
+    if (!c->relay) {
+        return e->frame_len;
+    }
+    for (size_t i = 0; i < e->n_route; ++i) {
+        if (e->route[i] == c->node_id) {
+            return 0;
+        }
+    }
+    return e->relay_frame_len;
+}
+
+/**
+ * Send a logged message to a client in the form it expects. Relays the
+ * message has already passed through are skipped.
+ *
+ * Returns 0 on success, or -1 if the client should be removed.
+ */
+int send_entry(client_connection *c, const replay_entry *e)
+{
+    size_t len = entry_len(c, e);
+    if (len == 0) {
+        return 0;
+    }
+    return send_frame(c, c->relay ? e->relay_frame : e->frame, len);
+}
+
+/**
+ * Send a frame, or the logged message `e` if it is not NULL, to every client
+ * which has said hello, removing clients whose connections have gone away.
+ *
+ * Returns the number of clients the frame was sent to.
+ */
+int broadcast(const char *buf, size_t len, const replay_entry *e)
+{
+    int sent = 0;
+    client_connection * c = clients;
+    while (c) {
+        if (!c->greeted) {
+            c = c->next;
+            continue;
+        }
+        if (e ? send_entry(c, e) : send_frame(c, buf, len)) {
+            TRACE(TRACE_INFO, TRACE_OP_CLIENT_REMOVE, c->fd);
+            c = remove_client(c);
+            continue;
+        }
+        TRACE(TRACE_DEBUG, TRACE_OP_SEND, c->fd);
+        ++sent;
+        c = c->next;
+    }
+
+    last_sent = time(NULL);
+    return sent;
+}
+
+void send_heartbeats(void)
+{
+    char frame[VCFS_FRAME_HEADER_SIZE + sizeof(uint64_t)];
+    size_t off = vcfs_put_frame_header(frame, VCFS_MSG_HEARTBEAT, sizeof(uint64_t));
+    vcfs_put_u64(frame + off, replay_last_seq());
+    broadcast(frame, sizeof(frame), NULL);
+}
+
+/**
+ * Answer a client's hello: welcome it, then replay what it missed or tell it
+ * to resynchronize.
+ *
+ * Returns 0 on success, or -1 if the client should be removed.
+ */
+int greet_client(client_connection *c)
+{
+    const char *body = c->hello + VCFS_FRAME_HEADER_SIZE;
+    if (c->hello_len == RELAY_HELLO_FRAME_SIZE && c->hello[sizeof(uint32_t)] == VCFS_MSG_RELAY_HELLO) {
+        c->relay = true;
+        c->node_id = vcfs_get_u64(body + 2 * sizeof(uint64_t));
+        if (c->node_id == node_id) {
+            // We are our own upstream.
+            TRACE(TRACE_ERROR, TRACE_OP_RELAY_LOOP, c->fd);
+            return -1;
+        }
+    } else if (c->hello_len != HELLO_FRAME_SIZE || c->hello[sizeof(uint32_t)] != VCFS_MSG_HELLO) {
+        return -1;
+    }
+    uint64_t client_epoch = vcfs_get_u64(body);
+    uint64_t client_seq = vcfs_get_u64(body + sizeof(uint64_t));
+    uint64_t seq = replay_last_seq();
+
+    char frame[VCFS_FRAME_HEADER_SIZE + 2 * sizeof(uint64_t) + sizeof(uint32_t)];
+    size_t off = vcfs_put_frame_header(frame, VCFS_MSG_WELCOME, sizeof(frame) - VCFS_FRAME_HEADER_SIZE);
+    vcfs_put_u64(frame + off, epoch);
+    vcfs_put_u64(frame + off + sizeof(uint64_t), seq);
+    vcfs_put_u32(frame + off + 2 * sizeof(uint64_t), heartbeat_secs);
+    if (send_frame(c, frame, sizeof(frame))) {
+        return -1;
+    }
+
+    // Replaying more than the client's queue holds would only get it
+    // disconnected again, so it has to fetch instead.
+    bool resume = client_epoch == epoch && replay_can_resume(client_seq);
+    size_t replay_len = 0;
+    for (uint64_t i = client_seq + 1; resume && i <= seq; ++i) {
+        replay_len += entry_len(c, replay_get(i));
+    }
+    if (resume && !queue_fits(c, replay_len)) {
+        resume = false;
+    }
+
+    if (resume) {
+        TRACE(TRACE_INFO, TRACE_OP_REPLAY, seq - client_seq);
+        for (uint64_t i = client_seq + 1; i <= seq; ++i) {
+            const replay_entry *e = replay_get(i);
+            if (send_entry(c, e)) {
+                return -1;
+            }
+        }
+    } else if (client_epoch != 0) {
+        // Missed notifications we no longer have, or too many to send;
+        // the client must fetch.
+        TRACE(TRACE_INFO, TRACE_OP_RESET, client_seq);
+        off = vcfs_put_frame_header(frame, VCFS_MSG_RESET, sizeof(uint64_t));
+        vcfs_put_u64(frame + off, seq);
+        if (send_frame(c, frame, off + sizeof(uint64_t))) {
+            return -1;
+        }
+    }
+
+    c->greeted = true;
+    return 0;
+}
+
+/**
+ * Assign a sequence number to a message and send it to every client.
+ */
+void publish(vcfs_msg_type type, const char *body, size_t len, const uint64_t *route, size_t n_route)
+{
+    const replay_entry *e = replay_append(type, body, len, route, n_route);
+    if (e == NULL) {
+        return;
+    }
+
+    uint64_t start = vcfs_trace_start(TRACE_INFO);
+    int sent = broadcast(NULL, 0, e);
+    TRACE_SPAN(TRACE_INFO, TRACE_OP_BROADCAST, start, sent, NULL);
+}
+
+/**
+ * Send a notification from our own hook to every client.
+ */
+void notify(const char *msg, size_t len)
+{
+    publish(VCFS_MSG_NOTIFY, msg, len, &node_id, 1);
+}
+
+/**
+ * Pass on a message from our upstream to every client, unless it has come
+ * round a cycle of relays. Messages are published in the order they arrive,
+ * so every client sees them in the order the root server sent them.
+ */
+void relay(vcfs_msg_type type, const char *body, size_t len, const uint64_t *route, size_t n_route)
+{
+    for (size_t i = 0; i < n_route; ++i) {
+        if (route[i] == node_id) {
+            TRACE(TRACE_ERROR, TRACE_OP_RELAY_LOOP, n_route);
+            return;
+        }
+    }
+    if (n_route >= VCFS_MAX_HOPS) {
+        TRACE(TRACE_ERROR, TRACE_OP_RELAY_LOOP, n_route);
+        return;
+    }
+
+    uint64_t full_route[VCFS_MAX_HOPS];
+    full_route[0] = node_id;
+    for (size_t i = 0; i < n_route; ++i) {
+        full_route[i + 1] = route[i];
+    }
+    TRACE_STRN(TRACE_DEBUG, TRACE_OP_RELAY, n_route, body, len);
+    publish(type, body, len, full_route, n_route + 1);
+}
+
+/**
+ * Pick a random identifier. Zero is left out, since clients use it to mean
+ * they have none yet.
+ *
+ * Returns 0 on success or -1 with errno set.
+ */
+int random_id(uint64_t *id)
+{
+    do {
+        ssize_t n;
+        do {
+            n = getrandom(id, sizeof(*id), 0);
+        } while (n < 0 && errno == EINTR);
+        if (n != (ssize_t)sizeof(*id)) {
+            return -1;
+        }
+    } while (*id == 0);
+    return 0;
+}
+
+uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Handle data from a client. The only thing clients send is their hello.
+ *
+ * Returns 0 on success, or -1 if the client should be removed.
+ */
+int read_client(client_connection *c)
+{
+    char buf[256];
+    char *data = buf;
+    ssize_t n;
+    // Read the hello's length, then the rest of it.
+    size_t hello_size = sizeof(uint32_t);
+    if (c->hello_len >= sizeof(uint32_t)) {
+        hello_size += vcfs_get_u32(c->hello);
+    }
+    if (c->greeted) {
+        n = read(c->fd, buf, sizeof(buf));
+    } else if (hello_size > sizeof(c->hello)) {
+        return -1;
+    } else {
+        data = c->hello + c->hello_len;
+        n = read(c->fd, data, hello_size - c->hello_len);
+    }
+    if (n <= 0) {
+        return -1;
+    }
+
+    if (!c->greeted) {
+        c->hello_len += n;
+        if (c->hello_len >= sizeof(uint32_t)
+                && c->hello_len == sizeof(uint32_t) + vcfs_get_u32(c->hello)) {
+            return greet_client(c);
+        }
+    }
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     if (argc < 3) {
-        fprintf(stderr, "Usage: %s <port> <hook_port>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <port> <hook_port> [<git_dir>]\n", argv[0]);
         return 1;
     }
 
     int port = atoi(argv[1]);
     int hookport = atoi(argv[2]);
+    if (argc > 3) {
+        maintenance_init(argv[3]);
+    }
 
     int hookfd = init_tcp_server(hookport);
     int serverfd = init_tcp_server(port);
@@ -113,17 +490,92 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    vcfs_trace_init("server");
+
+    const char *env = getenv("VCFS_REPLAY_LOG");
+    replay_init(env ? atoi(env) : 1024);
+    env = getenv("VCFS_HEARTBEAT_INTERVAL");
+    heartbeat_secs = env ? atoi(env) : 5;
+    if (heartbeat_secs <= 0) {
+        heartbeat_secs = 5;
+    }
+    env = getenv("VCFS_COALESCE_WINDOW_MS");
+    int window_ms = env ? atoi(env) : 250;
+    env = getenv("VCFS_COALESCE_MAX_DELAY_MS");
+    coalesce_init(window_ms, env ? atoi(env) : 2000);
+
+    if (random_id(&epoch) || random_id(&node_id)) {
+        perror("getrandom");
+        return 1;
+    }
+    last_sent = time(NULL);
+
+    env = getenv("VCFS_UPSTREAM");
+    if (env != NULL && upstream_init(env, node_id)) {
+        fprintf(stderr, "Invalid upstream %s, expected <ip>:<port>\n", env);
+        return 1;
+    }
+
     while (true) {
-        fd_set fds;
+        fd_set fds, wfds;
         FD_ZERO(&fds);
+        FD_ZERO(&wfds);
         FD_SET(serverfd, &fds);
         FD_SET(hookfd, &fds);
-        if (select((serverfd > hookfd ? serverfd : hookfd) + 1, &fds
-                    , NULL, NULL, NULL) < 0) {
+        int maxfd = serverfd > hookfd ? serverfd : hookfd;
+        for (client_connection *c = clients; c; c = c->next) {
+            FD_SET(c->fd, &fds);
+            if (c->out_len > 0) {
+                FD_SET(c->fd, &wfds);
+            }
+            if (c->fd > maxfd) maxfd = c->fd;
+        }
+        upstream_fds(&fds, &wfds, &maxfd);
+
+        int64_t timeout_ms = (int64_t)(last_sent + heartbeat_secs - time(NULL)) * 1000;
+        int maint_timeout = maintenance_timeout();
+        if (maint_timeout >= 0 && maint_timeout * 1000 < timeout_ms) {
+            timeout_ms = maint_timeout * 1000;
+        }
+        int coalesce_timeout_ms = coalesce_timeout(now_ms());
+        if (coalesce_timeout_ms >= 0 && coalesce_timeout_ms < timeout_ms) {
+            timeout_ms = coalesce_timeout_ms;
+        }
+        int upstream_timeout_ms = upstream_timeout();
+        if (upstream_timeout_ms >= 0 && upstream_timeout_ms < timeout_ms) {
+            timeout_ms = upstream_timeout_ms;
+        }
+        if (timeout_ms < 0) {
+            timeout_ms = 0;
+        }
+        struct timeval timeout = {
+            .tv_sec = timeout_ms / 1000,
+            .tv_usec = (timeout_ms % 1000) * 1000,
+        };
+        if (select(maxfd + 1, &fds, &wfds, NULL, &timeout) < 0) {
             perror("select");
             return 1;
         }
 
+        maintenance_poll();
+        coalesce_flush(now_ms(), notify);
+        upstream_poll(&fds, &wfds, relay);
+
+        if (time(NULL) >= last_sent + heartbeat_secs) {
+            send_heartbeats();
+        }
+
+        client_connection *c = clients;
+        while (c) {
+            if ((FD_ISSET(c->fd, &wfds) && flush_client(c))
+                    || (FD_ISSET(c->fd, &fds) && read_client(c))) {
+                TRACE(TRACE_INFO, TRACE_OP_CLIENT_REMOVE, c->fd);
+                c = remove_client(c);
+                continue;
+            }
+            c = c->next;
+        }
+
         if (FD_ISSET(hookfd, &fds)) {
             int hook_client = accept(hookfd, NULL, NULL);
             if (hook_client < 0) {
@@ -138,37 +590,32 @@ int main(int argc, char **argv)
             }
             size = ntohl(size);
 
-            int bufsize = sizeof(size) + size;
-            char * buf = (char *) malloc(bufsize);
+            // Leave room to relay it.
+            if (size > VCFS_MAX_FRAME_SIZE - VCFS_FRAME_HEADER_SIZE - sizeof(uint64_t) - VCFS_RELAY_OVERHEAD) {
+                fprintf(stderr, "hook message too long\n");
+                close(hook_client);
+                continue;
+            }
+
+            char * buf = (char *) malloc(size);
             if (buf == NULL) {
                 perror("malloc");
                 return 1;
             }
-            *((int *)buf) = htonl(size);
-            if (read(hook_client, buf+sizeof(size), size) != size) {
+            if (read(hook_client, buf, size) != size) {
                 perror("read");
                 free(buf);
                 return 1;
             }
             close(hook_client);
-            LOG("Recieved message %.*s", bufsize, buf);
-
-            client_connection * c = clients;
-            while (c) {
-                if (write(c->fd, buf, bufsize) == -1) {
-                    if (errno == EPIPE) {
-                        LOG("removing client %d", c->fd);
-                        c = remove_client(c);
-                        continue;
-                    } else {
-                        perror("write error not EPIPE");
-                    }
-                }
-                LOG("sending message to client %d", c->fd);
-                c = c->next;
-            }
+            TRACE_STRN(TRACE_INFO, TRACE_OP_HOOK_RECV, size, buf, size);
+            maintenance_note_push();
 
+            uint64_t now = now_ms();
+            coalesce_add(buf, size, now);
             free(buf);
+            // Sends right away if coalescing is turned off.
+            coalesce_flush(now, notify);
         }
 
         if (FD_ISSET(serverfd, &fds)) {
@@ -177,8 +624,20 @@ int main(int argc, char **argv)
                 perror("clientfd");
                 continue;
             }
+            if (clientfd >= FD_SETSIZE) {
+                fprintf(stderr, "client fd %d is too big for select, dropping it\n", clientfd);
+                close(clientfd);
+                continue;
+            }
+
+            // A slow client must not stall the others, see send_frame.
+            if (fcntl(clientfd, F_SETFL, O_NONBLOCK) == -1) {
+                perror("fcntl");
+                close(clientfd);
+                continue;
+            }
 
-            LOG("adding client %d", clientfd);
+            TRACE(TRACE_INFO, TRACE_OP_CLIENT_ADD, clientfd);
             add_client(clientfd);
         }
     }
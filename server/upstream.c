@@ -0,0 +1,324 @@
+#include "upstream.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+// As for clients: the upstream is presumed dead after this many heartbeat
+// intervals of silence.
+#define UPSTREAM_MISSED_HEARTBEATS 3
+#define UPSTREAM_CONNECT_TIMEOUT_SECS 5
+#define UPSTREAM_MAX_BACKOFF_SECS 60
+
+typedef struct upstream
+{
+    bool                enabled;
+    struct sockaddr_in  addr;
+    uint64_t            node_id;
+
+    int                 fd;
+    // Set while a non-blocking connect is in progress.
+    bool                connecting;
+    time_t              connect_deadline;
+    char                buf[VCFS_MAX_FRAME_SIZE];
+    size_t              buf_len;
+
+    // Where we are in the upstream's sequence of notifications.
+    uint64_t            epoch;
+    uint64_t            last_seq;
+    int                 heartbeat_secs;
+    time_t              last_heard;
+    time_t              reconnect_at;
+    int                 backoff_secs;
+} upstream;
+
+static upstream up = { .fd = -1 };
+
+int upstream_init(const char *addr, uint64_t node_id)
+{
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    const char *colon = strrchr(addr, ':');
+    if (colon == NULL || colon - addr >= (ptrdiff_t)sizeof(ip)) {
+        return -1;
+    }
+    memcpy(ip, addr, colon - addr);
+    ip[colon - addr] = '\0';
+    port = atoi(colon + 1);
+    if (port <= 0 || port > 65535 || inet_pton(AF_INET, ip, &up.addr.sin_addr) != 1) {
+        return -1;
+    }
+
+    up.addr.sin_family = AF_INET;
+    up.addr.sin_port = htons(port);
+    up.node_id = node_id;
+    up.heartbeat_secs = 5;
+    up.backoff_secs = 1;
+    up.enabled = true;
+    return 0;
+}
+
+static void disconnect(void)
+{
+    TRACE(TRACE_ERROR, TRACE_OP_UPSTREAM_LOST, up.last_seq);
+    close(up.fd);
+    up.fd = -1;
+    up.connecting = false;
+    up.buf_len = 0;
+
+    up.reconnect_at = time(NULL) + up.backoff_secs;
+    up.backoff_secs *= 2;
+    if (up.backoff_secs > UPSTREAM_MAX_BACKOFF_SECS) {
+        up.backoff_secs = UPSTREAM_MAX_BACKOFF_SECS;
+    }
+}
+
+/**
+ * Say hello to the upstream, asking for everything after what we last saw.
+ *
+ * Returns 0 on success, or -1 if the connection should be dropped.
+ */
+static int send_hello(void)
+{
+    char frame[VCFS_FRAME_HEADER_SIZE + 3 * sizeof(uint64_t)];
+    size_t off = vcfs_put_frame_header(frame, VCFS_MSG_RELAY_HELLO, 3 * sizeof(uint64_t));
+    vcfs_put_u64(frame + off, up.epoch);
+    vcfs_put_u64(frame + off + sizeof(uint64_t), up.last_seq);
+    vcfs_put_u64(frame + off + 2 * sizeof(uint64_t), up.node_id);
+
+    // Small enough to fit in an empty socket buffer.
+    ssize_t n;
+    do {
+        n = send(up.fd, frame, sizeof(frame), MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n != (ssize_t)sizeof(frame)) {
+        if (n < 0) {
+            perror("upstream hello");
+        }
+        return -1;
+    }
+    up.last_heard = time(NULL);
+    return 0;
+}
+
+static void start_connect(void)
+{
+    up.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (up.fd < 0) {
+        perror("socket");
+        up.reconnect_at = time(NULL) + up.backoff_secs;
+        return;
+    }
+    // The main loop waits on it with select.
+    if (up.fd >= FD_SETSIZE) {
+        fprintf(stderr, "upstream fd %d is too big for select\n", up.fd);
+        disconnect();
+        return;
+    }
+
+    if (connect(up.fd, (struct sockaddr *)&up.addr, sizeof(up.addr)) == 0) {
+        if (send_hello()) {
+            disconnect();
+        }
+        return;
+    }
+    if (errno != EINPROGRESS) {
+        disconnect();
+        return;
+    }
+    up.connecting = true;
+    up.connect_deadline = time(NULL) + UPSTREAM_CONNECT_TIMEOUT_SECS;
+}
+
+/**
+ * Handle one frame from the upstream.
+ *
+ * Returns 0 on success, or -1 if the connection should be dropped.
+ */
+static int handle_frame(const char *frame, size_t len, upstream_relay_fn relay)
+{
+    vcfs_msg_type type = (vcfs_msg_type)frame[sizeof(uint32_t)];
+    const char *body = frame + VCFS_FRAME_HEADER_SIZE;
+    size_t size = len - VCFS_FRAME_HEADER_SIZE;
+    if (size < sizeof(uint64_t)) {
+        return -1;
+    }
+    uint64_t seq = vcfs_get_u64(body);
+
+    switch (type) {
+    case VCFS_MSG_WELCOME:
+        if (size < 2 * sizeof(uint64_t) + sizeof(uint32_t)) {
+            return -1;
+        }
+        up.backoff_secs = 1;
+        up.heartbeat_secs = vcfs_get_u32(body + 2 * sizeof(uint64_t));
+        if (up.heartbeat_secs <= 0) {
+            up.heartbeat_secs = 5;
+        }
+        if (up.epoch != 0 && seq != up.epoch) {
+            // The upstream restarted and we can't tell what we missed, so
+            // neither can our clients.
+            relay(VCFS_MSG_RESET, "", 0, NULL, 0);
+        }
+        if (seq != up.epoch) {
+            up.epoch = seq;
+            up.last_seq = vcfs_get_u64(body + sizeof(uint64_t));
+        }
+        TRACE(TRACE_INFO, TRACE_OP_UPSTREAM_CONNECT, up.last_seq);
+        break;
+
+    case VCFS_MSG_RELAY: {
+        if (size < sizeof(uint64_t) + 2) {
+            return -1;
+        }
+        vcfs_msg_type relayed = (vcfs_msg_type)body[sizeof(uint64_t)];
+        size_t n_route = (uint8_t)body[sizeof(uint64_t) + 1];
+        size_t off = sizeof(uint64_t) + 2;
+        if (n_route > VCFS_MAX_HOPS || size < off + n_route * sizeof(uint64_t)
+                || (relayed != VCFS_MSG_NOTIFY && relayed != VCFS_MSG_RESET)) {
+            return -1;
+        }
+        if (seq <= up.last_seq) {
+            // Already seen, eg replayed across a reconnect.
+            break;
+        }
+        up.last_seq = seq;
+
+        uint64_t route[VCFS_MAX_HOPS];
+        for (size_t i = 0; i < n_route; ++i) {
+            route[i] = vcfs_get_u64(body + off);
+            off += sizeof(uint64_t);
+        }
+        relay(relayed, body + off, size - off, route, n_route);
+        break;
+    }
+
+    case VCFS_MSG_RESET:
+        // We fell off the end of the upstream's replay log.
+        if (seq != up.last_seq) {
+            up.last_seq = seq;
+            relay(VCFS_MSG_RESET, "", 0, NULL, 0);
+        }
+        break;
+
+    default:
+        // Heartbeats only need to arrive.
+        break;
+    }
+    return 0;
+}
+
+/**
+ * Read everything the upstream has sent, handling each complete frame.
+ *
+ * Returns 0 on success, or -1 if the connection should be dropped.
+ */
+static int read_upstream(upstream_relay_fn relay)
+{
+    while (true) {
+        ssize_t n = read(up.fd, up.buf + up.buf_len, sizeof(up.buf) - up.buf_len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        up.buf_len += n;
+        up.last_heard = time(NULL);
+
+        size_t off = 0;
+        while (up.buf_len - off >= VCFS_FRAME_HEADER_SIZE) {
+            size_t len = sizeof(uint32_t) + vcfs_get_u32(up.buf + off);
+            if (len < VCFS_FRAME_HEADER_SIZE || len > VCFS_MAX_FRAME_SIZE) {
+                return -1;
+            }
+            if (up.buf_len - off < len) {
+                break;
+            }
+            if (handle_frame(up.buf + off, len, relay)) {
+                return -1;
+            }
+            off += len;
+        }
+        memmove(up.buf, up.buf + off, up.buf_len - off);
+        up.buf_len -= off;
+    }
+}
+
+void upstream_fds(fd_set *rfds, fd_set *wfds, int *maxfd)
+{
+    if (up.fd < 0) {
+        return;
+    }
+    FD_SET(up.fd, up.connecting ? wfds : rfds);
+    if (up.fd > *maxfd) {
+        *maxfd = up.fd;
+    }
+}
+
+void upstream_poll(const fd_set *rfds, const fd_set *wfds, upstream_relay_fn relay)
+{
+    if (!up.enabled) {
+        return;
+    }
+
+    time_t now = time(NULL);
+    if (up.fd < 0) {
+        if (now >= up.reconnect_at) {
+            start_connect();
+        }
+        return;
+    }
+
+    if (up.connecting) {
+        if (FD_ISSET(up.fd, wfds)) {
+            int err = 0;
+            socklen_t err_len = sizeof(err);
+            getsockopt(up.fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+            up.connecting = false;
+            if (err || send_hello()) {
+                disconnect();
+            }
+        } else if (now >= up.connect_deadline) {
+            disconnect();
+        }
+        return;
+    }
+
+    if (FD_ISSET(up.fd, rfds) && read_upstream(relay)) {
+        disconnect();
+    } else if (now - up.last_heard > UPSTREAM_MISSED_HEARTBEATS * up.heartbeat_secs) {
+        disconnect();
+    }
+}
+
+int upstream_timeout(void)
+{
+    if (!up.enabled) {
+        return -1;
+    }
+
+    time_t deadline;
+    if (up.fd < 0) {
+        deadline = up.reconnect_at;
+    } else if (up.connecting) {
+        deadline = up.connect_deadline;
+    } else {
+        deadline = up.last_heard + UPSTREAM_MISSED_HEARTBEATS * up.heartbeat_secs + 1;
+    }
+
+    time_t now = time(NULL);
+    return deadline > now ? (int)(deadline - now) * 1000 : 0;
+}
@@ -0,0 +1,55 @@
+#ifndef VCFS_UPSTREAM_H
+#define VCFS_UPSTREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/select.h>
+
+#include "protocol.h"
+
+/**
+ * Relay mode: subscribe to another server and pass on what it sends, so a
+ * site's clients can share one connection to a distant server.
+ *
+ * The relay connects to its upstream like a client does, resuming from the
+ * last sequence number it saw whenever the connection is re-established,
+ * and gives everything it receives a sequence number of its own (see
+ * server.c). Its clients, which may themselves be relays, catch up against
+ * it exactly as they would against the server at the root. If the upstream
+ * can't replay what the relay missed, or restarted, the relay passes on a
+ * RESET so its clients fetch everything.
+ *
+ * Configured through the environment:
+ *   VCFS_UPSTREAM  <ip>:<port> of the server to relay; unset for a server
+ *                  which only takes notifications from its own hook
+ */
+
+typedef void (*upstream_relay_fn)(vcfs_msg_type type, const char *body, size_t body_len,
+                                  const uint64_t *route, size_t n_route);
+
+/**
+ * Relay the server at `addr`, calling ourselves `node_id`.
+ *
+ * Returns 0 on success, or -1 if `addr` is not an <ip>:<port>.
+ */
+int upstream_init(const char *addr, uint64_t node_id);
+
+/**
+ * Add the upstream connection to the sets select() should wait on.
+ */
+void upstream_fds(fd_set *rfds, fd_set *wfds, int *maxfd);
+
+/**
+ * Handle whatever the upstream connection is ready for, passing every
+ * NOTIFY and RESET received to `relay` in order, and reconnect if it is
+ * time to. Call this every time the server wakes up.
+ */
+void upstream_poll(const fd_set *rfds, const fd_set *wfds, upstream_relay_fn relay);
+
+/**
+ * Returns how many milliseconds the server may sleep before upstream_poll
+ * needs to be called again, or -1 if it can wait for the next event.
+ */
+int upstream_timeout(void);
+
+#endif
@@ -0,0 +1,200 @@
+#!/usr/bin/env bash
+#
+# Check that reads and writes through a mount keep going while the commit
+# worker holds the git lock.
+#
+# Mounts a local bare repository served by a local server, then makes the
+# worker's commit and merge slow with git hooks that sleep. While each is in
+# flight, parallel readers and writers work on other files, and every one of
+# them must finish long before the hook does. Anything that stalls is killed
+# and fails the test, and so does the whole run taking over $total_secs.
+#
+# Needs FUSE, and the client and server built (make -C client, make -C
+# server); exits with 77 without running if they are missing.
+# Usage: test/concurrency.sh [<client port> <hook port>]
+
+set -e
+
+# How long the whole run may take.
+total_secs=300
+if [ -z "$VCFS_TEST_BOUNDED" ]; then
+    VCFS_TEST_BOUNDED=1 exec timeout -k 10 $total_secs bash "$0" "$@"
+fi
+
+root="$(cd "$(dirname "$0")/.." && pwd)"
+client_port="${1:-9191}"
+hook_port="${2:-9192}"
+# How long the hooks hold the git lock, and how long a read or write may take.
+hold_secs=6
+limit_ms=2000
+# How long anything touching the mount may take before it counts as stalled.
+op_secs=20
+n_files=8
+
+if [ ! -c /dev/fuse ] || ! command -v fusermount > /dev/null \
+        || [ ! -x "$root/client/vcfs-client" ] || [ ! -x "$root/server/server" ]; then
+    echo "SKIP: needs /dev/fuse, fusermount, and the client and server built" >&2
+    exit 77
+fi
+
+tmp="$(mktemp -d)"
+mnt="$tmp/mnt"
+export VCFS_PREFIX="$tmp/prefix"
+export PATH="$root/cli:$root/client:$PATH"
+
+server_pid=
+function cleanup()
+{
+    timeout -k 1 $op_secs fusermount -u "$mnt" 2>/dev/null \
+        || fusermount -u -z "$mnt" 2>/dev/null || true
+    if [ -n "$server_pid" ]; then
+        kill "$server_pid" 2>/dev/null || true
+    fi
+    rm -rf "$tmp"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+function fail()
+{
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+function now_ms()
+{
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+# Run "$@", killing it if it is still going after $op_secs.
+function bounded()
+{
+    timeout -k 1 $op_secs "$@"
+}
+
+# Seed the repository through a scratch clone.
+git init -q --bare -b master "$tmp/origin.git"
+git init -q -b master "$tmp/seed"
+git -C "$tmp/seed" remote add origin "$tmp/origin.git"
+for i in $(seq $n_files); do
+    head -c 65536 /dev/urandom | base64 > "$tmp/seed/r$i"
+    echo "w$i" > "$tmp/seed/w$i"
+done
+git -C "$tmp/seed" add -A
+git -C "$tmp/seed" -c user.name=vcfs -c user.email=vcfs@localhost commit -q -m seed
+git -C "$tmp/seed" push -q -u origin master 2>/dev/null
+
+"$root/server/server" "$client_port" "$hook_port" "$tmp/origin.git" &
+server_pid=$!
+sleep 0.5
+
+mkdir "$mnt"
+repo="$VCFS_PREFIX/$mnt"
+mkdir -p "$(dirname "$repo")"
+git clone -q "$tmp/origin.git" "$repo" 2>/dev/null
+git -C "$repo" config user.name vcfs
+git -C "$repo" config user.email vcfs@localhost
+for hook in pre-commit post-merge; do
+    cat > "$repo/.git/hooks/$hook" <<EOF
+#!/bin/sh
+echo $hook > "$tmp/in-flight"
+sleep $hold_secs
+rm -f "$tmp/in-flight"
+EOF
+    chmod +x "$repo/.git/hooks/$hook"
+done
+bounded vcfs-mount "$mnt" "$tmp/origin.git" 127.0.0.1 "$client_port" \
+    || fail "mount failed or stalled"
+sleep 1
+
+# Wait up to 20 seconds for the worker to be inside hook $2.
+function wait_in_flight()
+{
+    for _ in $(seq 200); do
+        if [ "$(cat "$tmp/in-flight" 2>/dev/null)" == "$2" ]; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    fail "$1 never started"
+}
+
+# Wait up to a minute for the worker to finish the commits it has been
+# asked for.
+function wait_idle()
+{
+    local quiet=0
+    for _ in $(seq 60); do
+        if [ -e "$tmp/in-flight" ]; then
+            quiet=0
+        else
+            quiet=$(( quiet + 1 ))
+        fi
+        if (( quiet >= 3 )); then
+            return 0
+        fi
+        sleep 1
+    done
+    fail "the worker never went idle after $1"
+}
+
+# Read every r<n> and rewrite every w<n> in parallel, each in its own
+# process, and check that they all finished within the limit while the git
+# lock was still held.
+function check_parallel()
+{
+    rm -f "$tmp"/took-*
+    for i in $(seq $n_files); do
+        (
+            start=$(now_ms)
+            if bounded cat "$mnt/r$i" > /dev/null \
+                    && bounded stat "$mnt/r$i" > /dev/null \
+                    && bounded ls "$mnt" > /dev/null; then
+                echo $(( $(now_ms) - start )) > "$tmp/took-r$i"
+            else
+                echo failed > "$tmp/took-r$i"
+            fi
+        ) &
+        (
+            start=$(now_ms)
+            if bounded sh -c 'echo "$1" >> "$2"' - "$1 $i" "$mnt/w$i"; then
+                echo $(( $(now_ms) - start )) > "$tmp/took-w$i"
+            else
+                echo failed > "$tmp/took-w$i"
+            fi
+        ) &
+    done
+    wait $(jobs -p | grep -v "^$server_pid\$")
+
+    [ -e "$tmp/in-flight" ] || fail "$1 finished before the readers and writers"
+    for f in "$tmp"/took-*; do
+        took=$(cat "$f")
+        if [ "$took" == failed ]; then
+            fail "${f##*/took-} failed or stalled during $1"
+        fi
+        if (( took > limit_ms )); then
+            fail "${f##*/took-} took ${took}ms during $1"
+        fi
+    done
+    echo "ok: $1"
+}
+
+# A commit holds the git lock for the whole pre-commit hook.
+bounded sh -c 'echo change > "$1"' - "$mnt/w1" || fail "write stalled"
+wait_in_flight commit pre-commit
+check_parallel commit
+wait_idle commit
+
+# So does the merge of a pull, for the whole post-merge hook.
+git -C "$tmp/seed" pull -q 2>/dev/null
+echo pushed > "$tmp/seed/pushed"
+git -C "$tmp/seed" add pushed
+git -C "$tmp/seed" -c user.name=vcfs -c user.email=vcfs@localhost commit -q -m push
+git -C "$tmp/seed" push -q origin HEAD:master 2>/dev/null
+"$root/server/hook" 127.0.0.1 "$hook_port" master "$(git -C "$tmp/seed" rev-parse HEAD)"
+wait_in_flight pull post-merge
+check_parallel pull
+wait_idle pull
+
+bounded test -e "$mnt/pushed" || fail "pull did not bring in the push"
+echo "PASS"
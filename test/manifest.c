@@ -0,0 +1,107 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chunk.h"
+
+/**
+ * Check that manifests listing chunks we would never write are rejected,
+ * rather than read into buffers sized for the chunks we do write.
+ */
+
+#define HASH "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"
+
+static char root[] = "/tmp/vcfs-manifest-XXXXXX";
+static int failures;
+
+static int write_file(const char *path, const char *data, size_t len)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, data, len) != (ssize_t)len) {
+        perror(path);
+        exit(1);
+    }
+    return fd;
+}
+
+/**
+ * Write a manifest describing one chunk of `len` bytes, and check that
+ * loading it and materializing it both give `want`.
+ */
+static void check(const char *name, unsigned long long len, int want)
+{
+    char text[256];
+    int n = snprintf(text, sizeof(text), VCFS_MANIFEST_MAGIC "size %llu\n" HASH " %llu\n", len, len);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/manifest", root);
+    int fd = write_file(path, text, n);
+
+    vcfs_manifest m;
+    int res = vcfs_manifest_load(fd, &m);
+    if (res == 0) {
+        vcfs_manifest_free(&m);
+    }
+    if (res != want) {
+        fprintf(stderr, "FAIL: %s: load returned %d, expected %d\n", name, res, want);
+        ++failures;
+    }
+
+    snprintf(path, sizeof(path), "%s/out", root);
+    int out = write_file(path, "", 0);
+    res = vcfs_chunk_materialize(root, fd, out);
+    if (res != want) {
+        fprintf(stderr, "FAIL: %s: materialize returned %d, expected %d\n", name, res, want);
+        ++failures;
+    }
+
+    close(out);
+    close(fd);
+}
+
+int main(void)
+{
+    if (mkdtemp(root) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    // A chunk file bigger than any we write, so an unchecked manifest would
+    // read all of it.
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/.vcfs", root);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/" VCFS_CHUNK_DIR, root);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/" VCFS_CHUNK_DIR "/%.2s", root, HASH);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/" VCFS_CHUNK_DIR "/%.2s/" HASH, root, HASH);
+    size_t big = 5 * 1024 * 1024;
+    char *data = (char *)calloc(1, big);
+    close(write_file(path, data, big));
+    free(data);
+
+    check("1 MiB chunk", 1024 * 1024, 0);
+    check("empty chunk", 0, -EIO);
+    check("5 MiB chunk", big, -EIO);
+    check("chunk length overflowing 32 bits", 1ULL << 32, -EIO);
+
+    char cmd[PATH_MAX + 16];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "could not remove %s\n", root);
+    }
+
+    if (failures) {
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,152 @@
+#!/usr/bin/env bash
+#
+# Check relay mode with several servers on this host: notifications reach
+# the clients of a chain of relays in order, a relay whose upstream restarts
+# tells its clients to resynchronize, clients of a relay resume from its
+# replay log, and messages never go round a cycle of relays.
+#
+# Builds the server and test tools first. Usage: test/relay.sh [<base port>]
+
+set -e
+
+root="$(cd "$(dirname "$0")/.." && pwd)"
+base="${1:-9400}"
+make -s -C "$root/server"
+make -s -C "$root/test"
+
+server="$root/server/server"
+hook="$root/server/hook"
+watch="$root/test/vcfs-watch"
+
+tmp="$(mktemp -d)"
+pids=()
+function cleanup()
+{
+    kill "${pids[@]}" 2>/dev/null || true
+    wait 2>/dev/null || true
+    rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+export VCFS_COALESCE_WINDOW_MS=0
+export VCFS_HEARTBEAT_INTERVAL=1
+
+function fail()
+{
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+# Start a server on client port <base>+$1 and hook port <base>+$1+1,
+# relaying the one on client port <base>+$2 if given. Sets $pid.
+function start()
+{
+    if [ -n "$2" ]; then
+        VCFS_UPSTREAM="127.0.0.1:$(( base + $2 ))" "$server" $(( base + $1 )) $(( base + $1 + 1 )) &
+    else
+        "$server" $(( base + $1 )) $(( base + $1 + 1 )) &
+    fi
+    pid=$!
+    pids+=($pid)
+}
+
+# Push notification "$2 $3" into the server on client port <base>+$1.
+function push()
+{
+    "$hook" 127.0.0.1 $(( base + $1 + 1 )) "$2" "$3"
+}
+
+# Watch the server on client port <base>+$1 for $2 seconds, writing what
+# arrives to $tmp/$3. Any further arguments are the epoch and sequence
+# number to resume from.
+function watch()
+{
+    local port=$(( base + $1 ))
+    local secs=$2
+    local out="$tmp/$3"
+    shift 3
+    "$watch" $port $secs "$@" > "$out" &
+    pids+=($!)
+}
+
+# The messages of the notifications in $tmp/$1, one per line.
+function notified()
+{
+    grep '^notify ' "$tmp/$1" | cut -d' ' -f3- || true
+}
+
+# Check that the sequence numbers in $tmp/$1 only go up.
+function check_increasing()
+{
+    grep -E '^(notify|reset) ' "$tmp/$1" | cut -d' ' -f2 | sort -n -c \
+        || fail "$1: sequence numbers out of order"
+}
+
+echo "chain: root <- a <- b"
+start 0;           root=$pid
+start 10 0;        a=$pid
+start 20 10;       b=$pid
+sleep 2
+watch 0 3 root.out
+watch 20 12 b.out
+sleep 0.5
+for i in 1 2 3 4 5; do
+    push 0 master sha$i
+done
+push 10 dev shaA
+sleep 2
+
+[ "$(notified root.out)" == "$(printf 'master sha%s\n' 1 2 3 4 5)" ] \
+    || fail "root clients got: $(notified root.out)"
+[ "$(notified b.out | grep master)" == "$(printf 'master sha%s\n' 1 2 3 4 5)" ] \
+    || fail "relayed out of order: $(notified b.out)"
+[ "$(notified b.out | grep -c dev)" == 1 ] || fail "b clients did not get a's push once"
+check_increasing b.out
+echo "ok: notifications relayed in order"
+
+# Resume a client of b from its second notification.
+epoch=$(grep '^welcome ' "$tmp/b.out" | cut -d' ' -f2)
+seq=$(grep '^notify ' "$tmp/b.out" | sed -n 2p | cut -d' ' -f2)
+watch 20 1 resume.out "$epoch" "$seq"
+sleep 1.5
+[ "$(notified resume.out)" == "$(notified b.out | tail -n +3)" ] \
+    || fail "resumed client got: $(notified resume.out)"
+grep -q '^reset ' "$tmp/resume.out" && fail "resumed client was reset"
+echo "ok: relay clients resume from the replay log"
+
+# Restart the middle relay; b must pass on a reset, then carry on.
+kill $a
+wait $a 2>/dev/null || true
+push 0 master lost
+start 10 0; a=$pid
+sleep 4
+push 0 master final
+sleep 2
+grep -q '^reset ' "$tmp/b.out" || fail "b did not pass on a reset"
+[ "$(notified b.out | tail -n 1)" == "master final" ] || fail "b stopped relaying after the restart"
+check_increasing b.out
+echo "ok: upstream restarts reset relay clients"
+kill $root $a $b
+wait $root $a $b 2>/dev/null || true
+
+echo "cycle: c <-> d, and s <- s"
+start 30 40;       c=$pid
+start 40 30;       d=$pid
+start 50 50;       s=$pid
+sleep 2
+watch 30 2 c.out
+watch 40 2 d.out
+watch 50 2 s.out
+sleep 0.5
+push 30 master x
+push 40 master y
+push 50 master z
+sleep 2
+for out in c.out d.out; do
+    [ "$(notified $out | sort)" == "$(printf 'master %s\n' x y)" ] \
+        || fail "$out got: $(notified $out)"
+done
+[ "$(notified s.out)" == "master z" ] || fail "s.out got: $(notified s.out)"
+echo "ok: no message goes round a cycle"
+
+echo "PASS"
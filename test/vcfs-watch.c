@@ -0,0 +1,145 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "protocol.h"
+
+/**
+ * Subscribe to a server on this host like a client does, and print what it
+ * sends for a while, one line per message:
+ *
+ *     welcome <epoch> <seq>
+ *     notify <seq> <message>
+ *     reset <seq>
+ *
+ * Heartbeats are left out. Used by the tests to check what reaches clients.
+ */
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Print one frame.
+ *
+ * Returns 0 on success, or -1 if it is malformed.
+ */
+static int print_frame(const char *frame, size_t len)
+{
+    vcfs_msg_type type = (vcfs_msg_type)frame[sizeof(uint32_t)];
+    const char *body = frame + VCFS_FRAME_HEADER_SIZE;
+    size_t size = len - VCFS_FRAME_HEADER_SIZE;
+    if (size < sizeof(uint64_t)) {
+        return -1;
+    }
+    uint64_t seq = vcfs_get_u64(body);
+
+    switch (type) {
+    case VCFS_MSG_WELCOME:
+        if (size < 2 * sizeof(uint64_t)) {
+            return -1;
+        }
+        printf("welcome %llu %llu\n", (unsigned long long)seq,
+               (unsigned long long)vcfs_get_u64(body + sizeof(uint64_t)));
+        break;
+    case VCFS_MSG_NOTIFY:
+        printf("notify %llu %.*s\n", (unsigned long long)seq,
+               (int)(size - sizeof(uint64_t)), body + sizeof(uint64_t));
+        break;
+    case VCFS_MSG_RESET:
+        printf("reset %llu\n", (unsigned long long)seq);
+        break;
+    default:
+        break;
+    }
+    fflush(stdout);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3 && argc != 5) {
+        fprintf(stderr, "Usage: %s <port> <secs> [<epoch> <seq>]\n", argv[0]);
+        return 1;
+    }
+    int port = atoi(argv[1]);
+    uint64_t deadline = now_ms() + strtoull(argv[2], NULL, 10) * 1000;
+    uint64_t epoch = argc == 5 ? strtoull(argv[3], NULL, 10) : 0;
+    uint64_t seq = argc == 5 ? strtoull(argv[4], NULL, 10) : 0;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        return 1;
+    }
+
+    char hello[VCFS_FRAME_HEADER_SIZE + 2 * sizeof(uint64_t)];
+    size_t off = vcfs_put_frame_header(hello, VCFS_MSG_HELLO, 2 * sizeof(uint64_t));
+    vcfs_put_u64(hello + off, epoch);
+    vcfs_put_u64(hello + off + sizeof(uint64_t), seq);
+    if (write(fd, hello, sizeof(hello)) != (ssize_t)sizeof(hello)) {
+        perror("write");
+        return 1;
+    }
+
+    static char buf[VCFS_MAX_FRAME_SIZE];
+    size_t buf_len = 0;
+    uint64_t now;
+    while ((now = now_ms()) < deadline) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, (int)(deadline - now));
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            break;
+        }
+
+        ssize_t n = read(fd, buf + buf_len, sizeof(buf) - buf_len);
+        if (n <= 0) {
+            printf("closed\n");
+            return 0;
+        }
+        buf_len += n;
+
+        size_t done = 0;
+        while (buf_len - done >= VCFS_FRAME_HEADER_SIZE) {
+            size_t len = sizeof(uint32_t) + vcfs_get_u32(buf + done);
+            if (len < VCFS_FRAME_HEADER_SIZE || len > VCFS_MAX_FRAME_SIZE) {
+                fprintf(stderr, "bad frame\n");
+                return 1;
+            }
+            if (buf_len - done < len) {
+                break;
+            }
+            if (print_frame(buf + done, len)) {
+                fprintf(stderr, "bad frame\n");
+                return 1;
+            }
+            done += len;
+        }
+        memmove(buf, buf + done, buf_len - done);
+        buf_len -= done;
+    }
+
+    close(fd);
+    return 0;
+}